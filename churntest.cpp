@@ -0,0 +1,250 @@
+/*
+ * churntest.cpp
+ *
+ * Locks modeled on the "Octet" barriers of Bond et al.
+ *    "OCTET: Capturing and Controlling Cross-Thread Dependencies Efficiently"
+ *
+ * Measures the cost of short-lived threads.
+ *
+ *    Creates an array of "accounts" all initially 0
+ *    Repeatedly starts a few threads at a time, each of which
+ *          registers with octet, moves some money between accounts,
+ *          and then shuts down (leaving the accounts locked)
+ *    At the end, the sum of all accounts should be zero,
+ *          and memory use should not have grown with the number of threads.
+ *
+ *    With --contexts, the threads don't register with octet at all.
+ *    Instead they borrow contexts (see octet::attachContext) from a
+ *    shared pool, twice as large as a wave. Each thread does half its
+ *    work with one context, detaches it (locks and all) and puts it
+ *    back, then carries on with whichever context has been waiting
+ *    longest, typically one that another thread has just left. So the
+ *    threads keep asking detached contexts for their locks (and answer
+ *    for them; see octet::respondFor), and contexts keep moving between
+ *    OS threads.
+ *
+ * Author: Christopher A. Stone <stone@cs.hmc.edu>
+ *
+ */
+
+////////////////////////
+// CONTROL PARAMETERS //
+////////////////////////
+
+long NUM_THREADS = 1000000;      // How many threads are created in total
+
+int NUM_CONCURRENT = 8;          // How many threads run at once
+
+int NUM_ACCOUNTS = 1000;         // How many accounts the threads are choosing from
+
+int NUM_ITERATIONS = 10;         // How much work each thread does
+
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+
+#include "octet.hpp"
+
+
+// A lockable integer.
+
+struct Account {
+    volatile int balance_;
+    octet::Lock lock_;
+
+    Account() : balance_(0) {}
+};
+
+
+Account* accounts;
+
+// Moves money between random accounts, n times.
+void moveMoney(std::default_random_engine& engine, int n)
+{
+    std::uniform_int_distribution<int> dis(0,NUM_ACCOUNTS-1);
+
+    for (int i = 0; i < n; ++i) {
+        int from = dis(engine);
+        int to   = dis(engine);
+
+        if (from == to) {--i; continue; }
+
+        octet::lock(accounts[from].lock_,  true,
+                    accounts[to].lock_,    true);
+
+        --accounts[from].balance_;
+        ++accounts[to].balance_;
+    }
+}
+
+// Moves money between random accounts, then exits
+//    (still owning whatever it locked last).
+void churn(long threadNum)
+{
+    octet::initPerthread();
+
+    std::default_random_engine engine(threadNum);
+    moveMoney(engine, NUM_ITERATIONS);
+
+    octet::shutdownPerthread();
+}
+
+// The detached contexts (for --contexts), longest-waiting first.
+std::mutex poolLock;
+std::deque<octet::Context*> pool;
+
+long respondedFor = 0;    // Times respondFor found a context to act for
+
+octet::Context* takeContext()
+{
+    std::lock_guard<std::mutex> guard(poolLock);
+
+    octet::Context* ctx = pool.front();
+    pool.pop_front();
+
+    // (Requesters normally answer for detached contexts themselves,
+    //    but anyone may.)
+    if (! pool.empty() && octet::respondFor(pool.back())) ++respondedFor;
+
+    return ctx;
+}
+
+void returnContext(octet::Context* ctx)
+{
+    std::lock_guard<std::mutex> guard(poolLock);
+    pool.push_back(ctx);
+}
+
+// Like churn, but with borrowed contexts, swapping halfway through
+//    (and leaving both contexts' locks behind).
+void churnWithContexts(long threadNum)
+{
+    std::default_random_engine engine(threadNum);
+
+    octet::attachContext(takeContext());
+    moveMoney(engine, NUM_ITERATIONS / 2);
+    returnContext(octet::detachContext());
+
+    octet::attachContext(takeContext());
+    moveMoney(engine, NUM_ITERATIONS - NUM_ITERATIONS / 2);
+    returnContext(octet::detachContext());
+}
+
+// Maximum resident set size so far, in kilobytes.
+long maxRSS()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+int main(int argc, char** argv)
+{
+    // Command-line argument processing
+
+    //    churntest [--contexts] [threads [concurrent [accounts]]]
+
+    std::vector<std::string> args;
+
+    bool contexts = false;
+    for (int i = 1; i < argc; ++i) {
+        if (std::string(argv[i]) == "--contexts") {
+            contexts = true;
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+
+    if (args.size() >= 1) {
+        NUM_THREADS = std::max(1L, std::stol(args[0]));
+    }
+    if (args.size() >= 2) {
+        NUM_CONCURRENT = std::max(1, std::stoi(args[1]));
+    }
+    if (args.size() >= 3) {
+        NUM_ACCOUNTS = std::max(2, std::stoi(args[2]));
+    }
+
+    std::cout << "Run-time settings: NUM_THREADS=" << NUM_THREADS << "  "
+              << "NUM_CONCURRENT=" << NUM_CONCURRENT << "  "
+              << "NUM_ACCOUNTS=" << NUM_ACCOUNTS << "  "
+              << "CONTEXTS=" << contexts << "  "
+              << std::endl;
+
+    accounts = new Account[NUM_ACCOUNTS];
+    std::vector<std::thread> threads(NUM_CONCURRENT);
+
+    if (contexts) {
+        for (int i = 0; i < 2 * NUM_CONCURRENT; ++i) {
+            pool.push_back(octet::createContext());
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    long rssAfterFirstWave = 0;
+
+    for (long started = 0; started < NUM_THREADS; ) {
+
+        int wave = static_cast<int>(std::min<long>(NUM_CONCURRENT,
+                                                   NUM_THREADS - started));
+
+        for (int i = 0; i < wave; ++i) {
+            threads[i] = std::thread(contexts ? churnWithContexts : churn, started + i);
+        }
+        for (int i = 0; i < wave; ++i) {
+            threads[i].join();
+        }
+
+        if (started == 0) rssAfterFirstWave = maxRSS();
+
+        started += wave;
+
+        // Progress report (so we can watch memory while it runs).
+        if (started % (NUM_THREADS / 10 + 1) < static_cast<long>(wave)) {
+            std::cout << started << " threads  maxrss " << maxRSS() << "kB"
+                      << std::endl;
+        }
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    auto elapsed =
+       std::chrono::duration_cast<std::chrono::milliseconds>(end-start).count();
+
+    // Verify that nothing went wrong.
+    int sum = 0;
+    for (int i = 0; i < NUM_ACCOUNTS; ++i) {
+        sum += accounts[i].balance_;
+    }
+    assert (sum == 0);
+
+    if (contexts) {
+        std::cout << "responded for pooled contexts " << respondedFor
+                  << " times" << std::endl;
+        while (! pool.empty()) {
+            octet::destroyContext(pool.front());
+            pool.pop_front();
+        }
+    }
+
+    std::cout << elapsed << "ms  "
+              << (elapsed ? NUM_THREADS * 1000 / elapsed : 0) << " threads/s  "
+              << "maxrss " << rssAfterFirstWave << "kB -> " << maxRSS() << "kB"
+              << std::endl << std::endl;
+
+    delete[] accounts;
+
+    return 0;
+}
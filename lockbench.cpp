@@ -0,0 +1,541 @@
+/*
+ * lockbench.cpp
+ *
+ * Locks modeled on the "Octet" barriers of Bond et al.
+ *    "OCTET: Capturing and Controlling Cross-Thread Dependencies Efficiently"
+ *
+ * Compares octet locks with conventional locks on a few access patterns.
+ *
+ *    Creates an array of "objects" (a counter plus a lock)
+ *    For each kind of lock and each workload, starts some threads, each
+ *          of which repeatedly picks an object, locks it (for reading or
+ *          writing), and reads it or increments it, until time runs out
+ *    Reports throughput, how evenly the operations were spread over the
+ *          threads, and CPU time, as CSV (or JSON, with --json).
+ *    At the end of each run, the counters should add up to the number
+ *          of writes.
+ *
+ *    Octet locks are never unlocked, of course; the others are unlocked
+ *    after each operation. Instead, octet threads poll (octet::poll)
+ *    between operations, so that they respond to requests promptly.
+ *
+ * Author: Christopher A. Stone <stone@cs.hmc.edu>
+ *
+ */
+
+////////////////////////
+// CONTROL PARAMETERS //
+////////////////////////
+
+int NUM_THREADS = 4;             // How many threads run at once
+
+int DURATION_MS = 200;           // How long each run lasts
+
+int NUM_OBJECTS = 64;            // How many objects the threads share
+
+const int MIGRATION_OPS = 1000;  // Operations per phase of the migratory workload
+
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#if __cplusplus >= 201703L
+#include <shared_mutex>
+#endif
+
+#include "octet.hpp"
+
+
+////////////////////////
+// The locks
+////////////////////////
+
+// Each kind of lock is wrapped in a class with a name, and with
+//    readLock/readUnlock/writeLock/writeUnlock methods.
+
+// Spins briefly, then yields (so that a spinning thread doesn't starve
+//    the lock holder when there are more threads than cores).
+static inline void spinWait(int& spins)
+{
+    if (++spins < 100) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    } else {
+        std::this_thread::yield();
+    }
+}
+
+template <typename Policy>
+struct OctetLock {
+    octet::BasicLock<Policy> lock_;
+
+    static const bool isOctet = true;
+
+    void readLock()    { lock_.readLock(); }
+    void readUnlock()  {}
+    void writeLock()   { lock_.writeLock(); }
+    void writeUnlock() {}
+};
+
+struct OctetExclusive : OctetLock< octet::LockPolicy<false> > {
+    static const char* name() { return "octet"; }
+};
+
+struct OctetReadShared : OctetLock< octet::LockPolicy<true> > {
+    static const char* name() { return "octet-readshared"; }
+};
+
+struct Mutex {
+    std::mutex lock_;
+
+    static const bool isOctet = false;
+    static const char* name() { return "mutex"; }
+
+    void readLock()    { lock_.lock(); }
+    void readUnlock()  { lock_.unlock(); }
+    void writeLock()   { lock_.lock(); }
+    void writeUnlock() { lock_.unlock(); }
+};
+
+// std::shared_mutex is C++17; before that, use what it wraps on POSIX.
+struct SharedMutex {
+#if __cplusplus >= 201703L
+    std::shared_mutex lock_;
+
+    void readLock()    { lock_.lock_shared(); }
+    void readUnlock()  { lock_.unlock_shared(); }
+    void writeLock()   { lock_.lock(); }
+    void writeUnlock() { lock_.unlock(); }
+#else
+    pthread_rwlock_t lock_;
+
+    SharedMutex()  { pthread_rwlock_init(&lock_, nullptr); }
+    ~SharedMutex() { pthread_rwlock_destroy(&lock_); }
+
+    void readLock()    { pthread_rwlock_rdlock(&lock_); }
+    void readUnlock()  { pthread_rwlock_unlock(&lock_); }
+    void writeLock()   { pthread_rwlock_wrlock(&lock_); }
+    void writeUnlock() { pthread_rwlock_unlock(&lock_); }
+#endif
+
+    static const bool isOctet = false;
+    static const char* name() { return "shared_mutex"; }
+};
+
+// Test-and-test-and-set spinlock.
+struct SpinLock {
+    std::atomic<bool> locked_;
+
+    SpinLock() : locked_(false) {}
+
+    static const bool isOctet = false;
+    static const char* name() { return "ttas"; }
+
+    void writeLock()
+    {
+        int spins = 0;
+        for (;;) {
+            if (! locked_.load(std::memory_order_relaxed) &&
+                ! locked_.exchange(true, std::memory_order_acquire)) {
+                return;
+            }
+            spinWait(spins);
+        }
+    }
+
+    void writeUnlock() { locked_.store(false, std::memory_order_release); }
+    void readLock()    { writeLock(); }
+    void readUnlock()  { writeUnlock(); }
+};
+
+// MCS queue lock: each waiter spins on its own node.
+struct QueueLock {
+    struct Node {
+        std::atomic<Node*> next_;
+        std::atomic<bool> waiting_;
+    };
+
+    std::atomic<Node*> tail_;
+
+    // We only ever hold one lock at a time, so one node per thread will do.
+    static Node& myNode()
+    {
+        static __thread Node node;
+        return node;
+    }
+
+    QueueLock() : tail_(nullptr) {}
+
+    static const bool isOctet = false;
+    static const char* name() { return "mcs"; }
+
+    void writeLock()
+    {
+        Node& me = myNode();
+        me.next_.store(nullptr, std::memory_order_relaxed);
+        me.waiting_.store(true, std::memory_order_relaxed);
+
+        Node* prev = tail_.exchange(&me, std::memory_order_acq_rel);
+        if (prev != nullptr) {
+            prev->next_.store(&me, std::memory_order_release);
+            int spins = 0;
+            while (me.waiting_.load(std::memory_order_acquire)) {
+                spinWait(spins);
+            }
+        }
+    }
+
+    void writeUnlock()
+    {
+        Node& me = myNode();
+        Node* next = me.next_.load(std::memory_order_acquire);
+
+        if (next == nullptr) {
+            Node* expected = &me;
+            if (tail_.compare_exchange_strong(expected, nullptr,
+                                              std::memory_order_release)) {
+                return;
+            }
+            // Someone's joining the queue; wait for them to link in.
+            int spins = 0;
+            while ((next = me.next_.load(std::memory_order_acquire)) == nullptr) {
+                spinWait(spins);
+            }
+        }
+        next->waiting_.store(false, std::memory_order_release);
+    }
+
+    void readLock()    { writeLock(); }
+    void readUnlock()  { writeUnlock(); }
+};
+
+
+////////////////////////
+// The workloads
+////////////////////////
+
+// Each workload picks the next object for a thread, and whether to write it.
+
+struct Op {
+    int object;
+    bool write;
+};
+
+// Uniformly random objects; readPercent% of operations are reads.
+template <int ReadPercent>
+struct RandomWorkload {
+    std::default_random_engine engine_;
+    std::uniform_int_distribution<int> object_;
+    std::uniform_int_distribution<int> percent_;
+
+    explicit RandomWorkload(int threadNum)
+    : engine_(100*threadNum), object_(0, NUM_OBJECTS-1), percent_(0, 99) {}
+
+    Op next()
+    {
+        Op op = { object_(engine_), percent_(engine_) >= ReadPercent };
+        return op;
+    }
+};
+
+struct ReadHeavy : RandomWorkload<90> {
+    using RandomWorkload<90>::RandomWorkload;
+    static const char* name() { return "read-heavy"; }
+};
+
+struct WriteHeavy : RandomWorkload<10> {
+    using RandomWorkload<10>::RandomWorkload;
+    static const char* name() { return "write-heavy"; }
+};
+
+// Each thread writes its own object, except for 1% random reads of others.
+struct PrivateMostly {
+    int mine_;
+    std::default_random_engine engine_;
+    std::uniform_int_distribution<int> object_;
+    std::uniform_int_distribution<int> percent_;
+
+    explicit PrivateMostly(int threadNum)
+    : mine_(threadNum % NUM_OBJECTS), engine_(100*threadNum),
+      object_(0, NUM_OBJECTS-1), percent_(0, 99) {}
+
+    static const char* name() { return "private-mostly"; }
+
+    Op next()
+    {
+        if (percent_(engine_) == 0) {
+            Op op = { object_(engine_), false };
+            return op;
+        }
+        Op op = { mine_, true };
+        return op;
+    }
+};
+
+// The objects are split into one group per thread, and each thread
+//    writes within "its" group, but every MIGRATION_OPS operations it
+//    moves on to the next group, so the data migrates between threads.
+struct Migratory {
+    int threadNum_;
+    long ops_;
+    std::default_random_engine engine_;
+
+    explicit Migratory(int threadNum)
+    : threadNum_(threadNum), ops_(0), engine_(100*threadNum) {}
+
+    static const char* name() { return "migratory"; }
+
+    Op next()
+    {
+        int groups = std::min(NUM_THREADS, NUM_OBJECTS);
+        int group = (threadNum_ + ops_++ / MIGRATION_OPS) % groups;
+
+        // Objects group, group + groups, group + 2*groups, ...
+        int groupSize = (NUM_OBJECTS - group + groups - 1) / groups;
+        std::uniform_int_distribution<int> member(0, groupSize - 1);
+
+        Op op = { group + groups * member(engine_), true };
+        return op;
+    }
+};
+
+
+////////////////////////
+// Running them
+////////////////////////
+
+// (Padded, so that neighboring objects don't share a cache line.)
+template <typename Lock>
+struct Object {
+    Lock lock_;
+    volatile long value_;
+    char padding_[64];
+
+    Object() : value_(0) {}
+};
+
+struct Result {
+    std::string lock;
+    std::string workload;
+    long long elapsedMs;
+    long long cpuMs;
+    std::vector<long> ops;      // Per thread
+    long writes;
+};
+
+std::atomic<bool> running;
+
+template <typename Lock, typename Workload>
+void worker(Object<Lock>* objects, int threadNum, long* ops, long* writes)
+{
+    if (Lock::isOctet) octet::initPerthread();
+
+    Workload workload(threadNum);
+    long n = 0, w = 0;
+
+    while (running.load(std::memory_order_relaxed)) {
+        Op op = workload.next();
+        Object<Lock>& obj = objects[op.object];
+
+        if (op.write) {
+            obj.lock_.writeLock();
+            obj.value_ = obj.value_ + 1;
+            obj.lock_.writeUnlock();
+            ++w;
+        } else {
+            obj.lock_.readLock();
+            (void) obj.value_;
+            obj.lock_.readUnlock();
+        }
+        ++n;
+
+        if (Lock::isOctet) octet::poll();
+    }
+
+    *ops = n;
+    *writes = w;
+
+    if (Lock::isOctet) octet::shutdownPerthread();
+}
+
+// User + system time used by the process so far, in milliseconds.
+long long cpuMs()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000LL +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000;
+}
+
+template <typename Lock, typename Workload>
+Result run()
+{
+    std::vector< Object<Lock> > objects(NUM_OBJECTS);
+    std::vector<long> ops(NUM_THREADS), writes(NUM_THREADS);
+
+    running = true;
+
+    long long cpuStart = cpuMs();
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < NUM_THREADS; ++i) {
+        threads.push_back(std::thread(worker<Lock, Workload>,
+                                      objects.data(), i, &ops[i], &writes[i]));
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(DURATION_MS));
+    running = false;
+
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    auto end = std::chrono::steady_clock::now();
+
+    Result result;
+    result.lock = Lock::name();
+    result.workload = Workload::name();
+    result.elapsedMs =
+        std::chrono::duration_cast<std::chrono::milliseconds>(end-start).count();
+    result.cpuMs = cpuMs() - cpuStart;
+    result.ops = ops;
+    result.writes = 0;
+    for (long w : writes) result.writes += w;
+
+    // Verify that no increments were lost.
+    long sum = 0;
+    for (auto& obj : objects) sum += obj.value_;
+    assert (sum == result.writes);
+
+    return result;
+}
+
+template <typename Lock>
+void runWorkloads(std::vector<Result>& results)
+{
+    results.push_back(run<Lock, ReadHeavy>());
+    results.push_back(run<Lock, WriteHeavy>());
+    results.push_back(run<Lock, PrivateMostly>());
+    results.push_back(run<Lock, Migratory>());
+}
+
+
+////////////////////////
+// Reporting
+////////////////////////
+
+struct Summary {
+    long total, minimum, maximum;
+    double opsPerSec;
+};
+
+Summary summarize(const Result& r)
+{
+    Summary s;
+    s.total   = 0;
+    s.minimum = *std::min_element(r.ops.begin(), r.ops.end());
+    s.maximum = *std::max_element(r.ops.begin(), r.ops.end());
+    for (long n : r.ops) s.total += n;
+    s.opsPerSec = r.elapsedMs ? s.total * 1000.0 / r.elapsedMs : 0;
+    return s;
+}
+
+void printCSV(const std::vector<Result>& results)
+{
+    std::cout << "lock,workload,threads,objects,elapsed_ms,cpu_ms,ops,ops_per_sec,"
+              << "ops_per_thread_mean,ops_per_thread_min,ops_per_thread_max"
+              << std::endl;
+
+    for (const Result& r : results) {
+        Summary s = summarize(r);
+        std::cout << r.lock << "," << r.workload << ","
+                  << NUM_THREADS << "," << NUM_OBJECTS << ","
+                  << r.elapsedMs << "," << r.cpuMs << ","
+                  << s.total << "," << static_cast<long long>(s.opsPerSec) << ","
+                  << s.total / NUM_THREADS << "," << s.minimum << "," << s.maximum
+                  << std::endl;
+    }
+}
+
+void printJSON(const std::vector<Result>& results)
+{
+    std::cout << "[" << std::endl;
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        Summary s = summarize(r);
+
+        std::cout << "  {\"lock\": \"" << r.lock << "\", "
+                  << "\"workload\": \"" << r.workload << "\", "
+                  << "\"threads\": " << NUM_THREADS << ", "
+                  << "\"objects\": " << NUM_OBJECTS << ", "
+                  << "\"elapsed_ms\": " << r.elapsedMs << ", "
+                  << "\"cpu_ms\": " << r.cpuMs << ", "
+                  << "\"ops\": " << s.total << ", "
+                  << "\"ops_per_sec\": " << static_cast<long long>(s.opsPerSec) << ", "
+                  << "\"ops_per_thread\": [";
+        for (size_t t = 0; t < r.ops.size(); ++t) {
+            std::cout << (t ? ", " : "") << r.ops[t];
+        }
+        std::cout << "]}" << (i + 1 < results.size() ? "," : "") << std::endl;
+    }
+
+    std::cout << "]" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    // Command-line argument processing:
+    //    lockbench [--json] [threads [milliseconds [objects]]]
+    //    (--json may come anywhere on the line.)
+
+    std::vector<std::string> args;
+
+    bool json = false;
+    for (int i = 1; i < argc; ++i) {
+        if (std::string(argv[i]) == "--json") {
+            json = true;
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+
+    if (args.size() >= 1) {
+        NUM_THREADS = std::max(1, std::stoi(args[0]));
+    }
+    if (args.size() >= 2) {
+        DURATION_MS = std::max(1, std::stoi(args[1]));
+    }
+    if (args.size() >= 3) {
+        NUM_OBJECTS = std::max(1, std::stoi(args[2]));
+    }
+
+    std::vector<Result> results;
+
+    runWorkloads<OctetExclusive>(results);
+    runWorkloads<OctetReadShared>(results);
+    runWorkloads<Mutex>(results);
+    runWorkloads<SharedMutex>(results);
+    runWorkloads<SpinLock>(results);
+    runWorkloads<QueueLock>(results);
+
+    if (json) {
+        printJSON(results);
+    } else {
+        printCSV(results);
+    }
+
+    return 0;
+}
@@ -9,6 +9,10 @@
  */
 
 #include <atomic>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
 
 /////////////////////////
 
@@ -16,19 +20,68 @@
 
 // If DEBUG is set, the lock operations will produce copious debugging output.
 
+#ifndef DEBUG
 #define DEBUG 0
+#endif
 
 // If set, we use only default memory_order_sequential everywhere
 //    (I've tried to get the memory order constraints correct everywhere,
 //     but if the locks are not guaranteeing mutual exclusion, try turning
 //     this on and see if it helps.)
+#ifndef SEQUENTIAL
 #define SEQUENTIAL 0
+#endif
 
 // Should we gather/display lock statistics
+#ifndef STATISTICS
 #define STATISTICS 0
+#endif
 
 // Should we allow read/write locking (hence read-shared locking?)
+#ifndef READSHARED
 #define READSHARED 0
+#endif
+
+// Should a thread that has waited a while for another thread's response
+//    go to sleep (on a Linux futex) rather than continuing to yield?
+//    Helps when there are more threads than cores.
+#ifndef PARKING
+#define PARKING 0
+#endif
+
+#if PARKING && !defined(__linux__)
+#error "PARKING requires Linux futexes"
+#endif
+
+// Should a thread waiting for an INTERMEDIATE lock spin for a while
+//    before it starts yielding? (Only ever on a multiprocessor.) Off
+//    until multicore measurements show that it helps; build with
+//    -DSPIN_ON_INTERMEDIATE=1 to measure it.
+#ifndef SPIN_ON_INTERMEDIATE
+#define SPIN_ON_INTERMEDIATE 0
+#endif
+
+// The starting value of every thread's request and response counts.
+//    Only useful for testing that the counters wrap around correctly
+//    (see the soaktest target in the Makefile); e.g., -2000000 makes
+//    them wrap after about a million requests.
+#ifndef OCTET_COUNT_START
+#define OCTET_COUNT_START 0
+#endif
+
+// Should locks be 32 bits (rather than pointer-sized), naming their
+//    owners by a small thread number instead of a pointer? Halves the
+//    size of a lock on 64-bit machines, at the cost of a table lookup
+//    whenever a slow path needs the owner, and of having only 30
+//    reader bits for RdSh locks. (See octetLockState_t below.)
+#ifndef OCTET_COMPACT_LOCKS
+#define OCTET_COMPACT_LOCKS 0
+#endif
+
+// (Each of the above can be overridden from the compiler command line,
+//  e.g., -DREADSHARED=1, as long as the library and its clients agree.
+//  DEBUG, SEQUENTIAL, STATISTICS and READSHARED are really just the
+//  defaults for individual locks; see LockPolicy below.)
 
 /////////////////////////
 
@@ -56,6 +109,11 @@
 #define TRACE(...)
 #endif
 
+// PTRACE is the equivalent of TRACE for code templated over a
+// LockPolicy P; it prints if P's Debug flag is set.
+
+#define PTRACE(P, ...) do { if ( P::debug ) atomic_printf(__VA_ARGS__); } while (0)
+
 /////////////////////////
 
 
@@ -69,7 +127,8 @@ namespace octet {
     // OctetThreadInfo
     //
     // Each thread maintains exactly one of these objects (in the thread-local
-    //    variable myThreadInfo).
+    //    variable myThreadInfo). [Or, more generally, each context; see
+    //    octet.hpp.]
     // It tracks three pieces of data:
     //    (1) How many times threads have requested locks from them
     //    (2) Whether the thread is currently blocked (and hence
@@ -81,48 +140,330 @@ namespace octet {
     //     that we have not yet agreed to (unless we're blocked).
     // And if (1) == (3), then there are no pending requests.
     //
-    // For efficiency, we keep (1) and (2) in the same 32-bit word.
-    //   Item (1) occupies the high 31 bits (to get the count, must ">> 1")
+    // For efficiency, we keep (1) and (2) in the same octetCount_t word.
+    //   Item (1) occupies the high bits (each request adds 2; to get the
+    //            count, must "& ~1")
     //   Item (2) occupies the low bit (to get the flag, must "& 1")
-    // This limits us to 2 billion lock requests. If it's a problem, we can
-    // switch to 63-bit counters...
+    //
+    // Similarly, (3) occupies the high bits of its own word, and the
+    //   low bit says whether some thread is (or is about to be) asleep
+    //   waiting for (3) to change. [Only used if PARKING is set.]
+    //
+    // The counts are allowed to wrap around, so they must only be
+    //   compared for equality or with countReached (see octet.cpp),
+    //   never with "<".
+
+    // octetCount_t
+    //
+    // 64 bits where atomics that wide are cheap (so the counts never
+    // actually wrap), 32 bits otherwise.
+#if UINTPTR_MAX > 0xffffffffu
+    using octetCount_t = uint64_t;
+#else
+    using octetCount_t = uint32_t;
+#endif
+
+    // Transition
+    //
+    // The ways a slow path can change the state of a lock (the "from"
+    // state belonged to another thread, except for UPGRADE, which is
+    // a thread turning its own RdEx lock into a WrEx lock).
+    enum Transition {
+        WREX_TO_WREX,
+        WREX_TO_RDEX,
+        RDEX_TO_WREX,
+        RDEX_TO_RDSH,
+        RDSH_TO_WREX,
+        RDSH_TO_RDSH,   // i.e., joining the readers
+        UPGRADE,
+        RELEASED_TO_OWNED,  // taking a lock some thread released (see releaseLock),
+                            //   or that nobody held
+        NUM_TRANSITIONS
+    };
+
+    // The slow-path wait histograms have one bucket per power of two
+    //    nanoseconds: bucket i counts waits of [2^i, 2^(i+1)) ns, except
+    //    that bucket 0 includes 0, and the last bucket includes everything
+    //    longer (about 4 seconds).
+    const unsigned HISTOGRAM_BUCKETS = 32;
+
+    using statCounter_t = std::atomic<uint64_t>;
+
+    // ThreadStats
+    //
+    // The statistics gathered by one OctetThreadInfo, for locks whose
+    // policy has Statistics set (see LockPolicy), except for lockRestarts,
+    // which is always kept.
+    //
+    // Only the thread acting for the OctetThreadInfo updates these, but
+    // any thread may read them at any time (see getStatistics in octet.hpp),
+    // so they're atomics updated with a relaxed load and store (see bump)
+    // rather than a more expensive read-modify-write.
+    struct ThreadStats {
+        statCounter_t writeBarriers;
+        statCounter_t slowWrites;
+        statCounter_t readBarriers;
+        statCounter_t slowReads;
+        statCounter_t transitions[NUM_TRANSITIONS];
+
+        // Times that octet::lock had to start over.
+        statCounter_t lockRestarts;
+
+        // Time spent in the slow paths waiting to make a lock
+        //    INTERMEDIATE, and waiting for the previous owner(s) to respond.
+        statCounter_t intermediateNs[HISTOGRAM_BUCKETS];
+        statCounter_t awaitNs[HISTOGRAM_BUCKETS];
+
+        ThreadStats();
+    };
+
+    // bump
+    //
+    // Increments a counter in our own ThreadStats.
+    //
+    inline void bump( statCounter_t& counter )
+    {
+        counter.store( counter.load( std::memory_order_relaxed ) + 1,
+                       std::memory_order_relaxed );
+    }
+
+    struct ProfileBuffer;  // See octet.cpp
 
     struct OctetThreadInfo {
-        std::atomic<uint32_t> requests_;  // 31 bit count + 1 bit "blocked" flag.
+        std::atomic<octetCount_t> requests_;  // count + 1 bit "blocked" flag.
         char padding[64 - sizeof(requests_)];
-        std::atomic<uint32_t> responses_;
+        std::atomic<octetCount_t> responses_; // count + 1 bit "parked" flag.
+
+        // The bit this thread sets in the reader set of a RdSh lock
+        //    (see octetLockState_t below). Several threads may share
+        //    a bit, so a set bit only means that *some* thread using
+        //    that bit may be reading.
+        uintptr_t readerBit_;
+
+        // Where this thread is registered (see octet.cpp).
+        unsigned slot_;
+
+        // This thread's number in compact lock states (see octetLockState_t
+        //    below): slot_ + 2, or 1 for noThreadInfo(). (0 is never used,
+        //    so that the intermediate states can't be mistaken for an owner.)
+        uint32_t id_;
+
+        // Whether some thread is currently acting for this OctetThreadInfo
+        //    (see attachContext in octet.hpp).
+        std::atomic<bool> attached_;
+
+        // The (Linux) thread id of the thread it's attached to, or 0;
+        //    where to send response signals (see setResponseSignal).
+        std::atomic<int> tid_;
+
+        // Sampled lock transitions, if profiling has ever been turned on
+        //    (see setProfileSampling in octet.hpp).
+        std::atomic<ProfileBuffer*> profile_;
+
+        // (The fast paths bump these all the time, so keep them off the
+        //    cache line that requesters poll responses_ on.)
+        char statsPadding[64];
+        ThreadStats stats_;
 
         OctetThreadInfo( bool startBlocked = false );
 
         void handleRequests( bool shouldBlock );
         void unblock();
 
+    private:
+        void respond( octetCount_t request_count );
+
     };
 
     extern __thread OctetThreadInfo* myThreadInfo;
 
+    // Whether this thread is inside an AsyncSafeScope (see octet.hpp),
+    //    so that a response signal can be handled right away.
+    extern __thread volatile sig_atomic_t asyncSafe;
+
 
     // octetLockState_t
     //
     // The underlying representation for per-object locks consists of an
-    // pointer-sized value. We distinguish four possibilities:
-    //   (1) the value 0 means the lock is in read-shared mode
-    //   (2) the value 1 means the lock is in "intermediate mode"
+    // pointer-sized value. The low two bits are a tag:
+    //   (1) the value 1 means the lock is in "intermediate mode"
     //            (in the process of being acquired by a new thread)
-    // Otherwise, the value gives us a pointer to an OctetThreadInfo
-    //   (3) if the least-significant-bit is 0, it's locked for writing
-    //           (and the pointer points to the owner's OctetThreadInfo object)
-    //   (4) if the least-significant-bit is 1, it's locked for reading
+    //       and the value 3 means the same, but also that some thread
+    //            is asleep waiting for it to change [if PARKING is set].
+    // Otherwise, if the tag is
+    //   (2) 00, it's locked for writing
+    //           (and the value is a pointer to the owner's OctetThreadInfo)
+    //   (3) 01, it's locked for reading
     //           (and we need to zero out that bit before following the pointer).
+    //   (4) 10, it's in read-shared mode, and the remaining bits are the
+    //           set of readerBit_'s of the threads that may be reading it.
+    //           A writer only has to get permission from those threads,
+    //           rather than from every running thread.
+    //   (5) 11, it's been released (see releaseLock), and the remaining
+    //           bits are a pointer to the thread that released it.
+    //           Anyone can take it with a single compare_exchange.
+    //           Locks that nobody holds (new or force-unlocked) are
+    //           "released" by noThreadInfo().
+    //
+    // OctetThreadInfo objects are (at least) 4-byte aligned, so the tag
+    // bits of a pointer are always zero.
+    //
+    // If OCTET_COMPACT_LOCKS is set, the value is 32 bits, and the "pointers"
+    // in (2), (3) and (5) are instead the owner's id_ shifted left by two,
+    // which threadsById (see octet.cpp) maps back to the OctetThreadInfo.
+#if OCTET_COMPACT_LOCKS
+    using octetLockState_t = uint32_t;
+
+    extern std::atomic<OctetThreadInfo*> threadsById[];
+#else
     using octetLockState_t = uintptr_t;
+#endif
 
     // octetLock_t
     //
-    // Per-object locks are just the above pointer-sized value,
-    // wrapped in a C++ atomic.
+    // Per-object locks are just the above value, wrapped in a C++ atomic.
     //
     using octetLock_t = std::atomic<octetLockState_t>;
 
+    // Intrusive locks
+    //
+    // An intrusive lock (see BasicIntrusiveLock in octet.hpp) keeps its
+    // state in one half of a 64-bit atomic word of the caller's, whose
+    // other half the caller may be changing at the same time. Its
+    // octetLock_t* is the word's address, tagged with INTRUSIVE_LOCK
+    // (and INTRUSIVE_HIGH, if the lock takes the high half of the word's
+    // value), and is never dereferenced: everything that touches a lock
+    // goes through loadLock, compareExchangeLock and friends (below),
+    // which load and compare_exchange the whole word, keeping the
+    // caller's half as it was. Only 32-bit lock states fit; otherwise
+    // there are no intrusive locks, and the check costs nothing.
+    //
+    const uintptr_t INTRUSIVE_LOCK = 1;
+    const uintptr_t INTRUSIVE_HIGH = 2;
+    const bool INTRUSIVE_LOCKS = sizeof(octetLockState_t) == 4;
+
+    inline bool isIntrusive( const octetLock_t* objLock )
+    {
+        return INTRUSIVE_LOCKS &&
+               ( reinterpret_cast<uintptr_t>( objLock ) & INTRUSIVE_LOCK ) != 0;
+    }
+
+    // The word an intrusive lock lives in, and how far up it.
+    inline std::atomic<uint64_t>* intrusiveWord( const octetLock_t* objLock )
+    {
+        return reinterpret_cast<std::atomic<uint64_t>*>(
+            reinterpret_cast<uintptr_t>( objLock ) & ~( INTRUSIVE_LOCK | INTRUSIVE_HIGH ) );
+    }
+
+    inline unsigned intrusiveShift( const octetLock_t* objLock )
+    {
+        return ( reinterpret_cast<uintptr_t>( objLock ) & INTRUSIVE_HIGH ) ? 32 : 0;
+    }
+
+    // loadLock
+    //
+    //  objLock->load( mo ), for any lock.
+    //
+    inline octetLockState_t loadLock( const octetLock_t* objLock,
+                                      std::memory_order mo = std::memory_order_seq_cst )
+    {
+        if ( isIntrusive( objLock ) ) {
+            return static_cast<octetLockState_t>(
+                intrusiveWord( objLock )->load( mo ) >> intrusiveShift( objLock ) );
+        }
+        return objLock->load( mo );
+    }
+
+    // compareExchangeIntrusive
+    //
+    //  compare_exchange on an intrusive lock's half of its word. If the
+    //    caller's half changes under us, we try again if retry is set
+    //    (as compare_exchange_strong must), and otherwise fail spuriously
+    //    (as compare_exchange_weak may).
+    //
+    inline bool compareExchangeIntrusive( const octetLock_t* objLock,
+                                          octetLockState_t& expected,
+                                          octetLockState_t desired, bool retry,
+                                          std::memory_order success,
+                                          std::memory_order failure )
+    {
+        std::atomic<uint64_t>* word = intrusiveWord( objLock );
+        unsigned shift = intrusiveShift( objLock );
+        uint64_t lockBits = static_cast<uint64_t>( 0xffffffff ) << shift;
+
+        uint64_t cur = word->load( failure );
+
+        do {
+            octetLockState_t state = static_cast<octetLockState_t>( cur >> shift );
+            if ( state != expected ) {
+                expected = state;
+                return false;
+            }
+
+            uint64_t next = ( cur & ~lockBits ) | ( static_cast<uint64_t>( desired ) << shift );
+            if ( word->compare_exchange_weak( cur, next, success, failure ) ) {
+                return true;
+            }
+        } while ( retry );
+
+        expected = static_cast<octetLockState_t>( cur >> shift );
+        return false;
+    }
+
+    // compareExchangeLockWeak, compareExchangeLockStrong, exchangeLock, storeLock
+    //
+    //  objLock->compare_exchange_weak( ... ) and so on, for any lock. (An
+    //    intrusive lock only has compare_exchange, so it stores by
+    //    exchanging, and exchanges by compare_exchange'ing until it works.)
+    //
+    inline bool compareExchangeLockWeak( octetLock_t* objLock,
+                                         octetLockState_t& expected, octetLockState_t desired,
+                                         std::memory_order success = std::memory_order_seq_cst,
+                                         std::memory_order failure = std::memory_order_seq_cst )
+    {
+        if ( isIntrusive( objLock ) ) {
+            return compareExchangeIntrusive( objLock, expected, desired, false,
+                                             success, failure );
+        }
+        return objLock->compare_exchange_weak( expected, desired, success, failure );
+    }
+
+    inline bool compareExchangeLockStrong( octetLock_t* objLock,
+                                           octetLockState_t& expected, octetLockState_t desired,
+                                           std::memory_order success = std::memory_order_seq_cst,
+                                           std::memory_order failure = std::memory_order_seq_cst )
+    {
+        if ( isIntrusive( objLock ) ) {
+            return compareExchangeIntrusive( objLock, expected, desired, true,
+                                             success, failure );
+        }
+        return objLock->compare_exchange_strong( expected, desired, success, failure );
+    }
+
+    inline octetLockState_t exchangeLock( octetLock_t* objLock, octetLockState_t desired,
+                                          std::memory_order mo = std::memory_order_seq_cst )
+    {
+        if ( isIntrusive( objLock ) ) {
+            octetLockState_t prev = loadLock( objLock, std::memory_order_relaxed );
+            while ( ! compareExchangeIntrusive( objLock, prev, desired, false,
+                                                mo, std::memory_order_relaxed ) ) {
+                // Try again (prev was updated)
+            }
+            return prev;
+        }
+        return objLock->exchange( desired, mo );
+    }
+
+    inline void storeLock( octetLock_t* objLock, octetLockState_t desired,
+                           std::memory_order mo = std::memory_order_seq_cst )
+    {
+        if ( isIntrusive( objLock ) ) {
+            exchangeLock( objLock, desired, mo );
+            return;
+        }
+        objLock->store( desired, mo );
+    }
+
 
     // The following macros are useful for octetLockState_t values.
     //  * WrEx(T): Thread T may read or write the object without changing the state.
@@ -130,15 +471,89 @@ namespace octet {
     //  * RdSh   : Any thread may read but not write the object without changing
     //                the state.
 
-#define RDSH         0L
+#define RDSH_TAG     2L
 #define INTERMEDIATE 1L
+#define INTERMEDIATE_PARKED 3L
+#if OCTET_COMPACT_LOCKS
+#define WREX(T)      (static_cast<octetLockState_t>((T)->id_ << 2))
+#define ID_TO_TID(X) (threadsById[(X) >> 2].load(std::memory_order_acquire))
+#else
 #define WREX(T)      (reinterpret_cast<octetLockState_t>(T))
-#define RDEX(T)      (reinterpret_cast<octetLockState_t>(T) | 0x1)
+#define ID_TO_TID(X) (reinterpret_cast<OctetThreadInfo*>(X))
+#endif
+#define RDEX(T)      (WREX(T) | 0x1)
+#define RDSH(R)      ((R) | RDSH_TAG)
+#define RELEASED(T)  (WREX(T) | 0x3)
+
+// OWNED_BY works on any state (unlike GET_TID, which only makes sense
+//    for WrEx and RdEx ones): whether it's WrEx(T) or RdEx(T).
+#define OWNED_BY(X,T) (((X) & ~static_cast<octetLockState_t>(1)) == WREX(T))
+#define GET_TID(X)   ID_TO_TID((X) & ~static_cast<octetLockState_t>(1))
+#define GET_READERS(X) ((X) & ~3)
+#define IS_WREX(X)   ((X) != 0L && ((X) & 0x3) == 0)
+#define IS_RDEX(X)   ((X) != 1L && ((X) & 0x3) == 1)
+#define IS_RDSH(X)   (((X) & 0x3) == RDSH_TAG)
+#define IS_INTERMEDIATE(X) (((X) | 0x2) == INTERMEDIATE_PARKED)
+#define IS_RELEASED(X) (((X) & 0x3) == 0x3 && (X) != INTERMEDIATE_PARKED)
+#define GET_RELEASER(X) ID_TO_TID((X) & ~static_cast<octetLockState_t>(3))
+
+    // myWrEx
+    //
+    // WREX(myThreadInfo), kept up to date by attachContext and
+    //    detachContext, so that in compact mode the fast paths compare
+    //    lock states with a thread-local rather than loading
+    //    myThreadInfo->id_ first. (Otherwise WREX(myThreadInfo) is
+    //    myThreadInfo itself, and costs nothing extra.)
+#if OCTET_COMPACT_LOCKS
+    extern __thread octetLockState_t myWrEx;
+#define MY_WREX      (myWrEx)
+#else
+#define MY_WREX      WREX(myThreadInfo)
+#endif
+#define MY_RDEX      (MY_WREX | 0x1)
+#define OWNED_BY_ME(X) (((X) & ~static_cast<octetLockState_t>(1)) == MY_WREX)
 
-#define GET_TID(X)   (reinterpret_cast<OctetThreadInfo*>((X) & ~1))
-#define IS_WREX(X)   ((X) != 0L && ((X) & 0x1) == 0)
-#define IS_RDEX(X)   ((X) != 1L && ((X) & 0x1) != 0)
-#define IS_RDSH(X)   ((X) == RDSH)
+    // The number of distinct reader bits available in a RdSh lock.
+    const unsigned READER_BITS = 8 * sizeof(octetLockState_t) - 2;
+
+#define READER_BIT(I) (static_cast<octetLockState_t>(1) << (2 + (I) % READER_BITS))
+
+
+    // LockPolicy
+    //
+    // The compile-time configuration of a lock (see BasicLock in octet.hpp).
+    // Each flag does what the corresponding #define above does, but only
+    // for the locks using this policy, so that (say) exclusive-only locks
+    // and read-shared locks can coexist in one program:
+    //    ReadShared: read locking allows several readers at once
+    //                (otherwise it's the same as write locking).
+    //    Statistics: count barriers, slow paths and lock transitions on
+    //                these locks, and time their slow paths.
+    //    Sequential: use memory_order_seq_cst for all accesses to the lock.
+    //    Debug:      trace operations on these locks.
+    //
+    // The per-thread request/response protocol is shared by all locks, so
+    // it still follows SEQUENTIAL and DEBUG.
+    //
+    // The library contains the slow paths for every LockPolicy, so any
+    // combination can be used without rebuilding it.
+    template <bool ReadShared = (READSHARED != 0), bool Statistics = (STATISTICS != 0),
+              bool Sequential = (SEQUENTIAL != 0), bool Debug = (DEBUG != 0)>
+    struct LockPolicy {
+        static const bool readShared = ReadShared;
+        static const bool statistics = Statistics;
+        static const bool sequential = Sequential;
+        static const bool debug      = Debug;
+
+        // The memory order to use in place of mo (cf. MEM_ORD).
+        static constexpr std::memory_order order( std::memory_order mo )
+        {
+            return Sequential ? std::memory_order_seq_cst : mo;
+        }
+    };
+
+    // The configuration chosen by the #defines.
+    using DefaultPolicy = LockPolicy<>;
 
 
 
@@ -149,18 +564,86 @@ namespace octet {
 
     // Declare internal variables/functions used by the inline methods
 
-#if STATISTICS
-    extern __thread size_t writeBarriers;
-    extern __thread size_t slowWrites;
-    extern __thread size_t readBarriers;
-    extern __thread size_t slowReads;
-#endif
-
-    bool readSlowPath( octetLock_t* objLock );
-    bool writeSlowPath( octetLock_t* objLock );
+    template <typename Policy> bool readSlowPath( octetLock_t* objLock );
+    template <typename Policy> bool writeSlowPath( octetLock_t* objLock );
 
     int atomic_printf(const char *format, ...);
 
+    OctetThreadInfo* noThreadInfo();
+
+    // unownedState
+    //
+    // The state of a lock that nobody holds.
+    inline octetLockState_t unownedState() { return RELEASED( noThreadInfo() ); }
+
+    void forceUnlock( octetLock_t* objLock );
+    void releaseSlowPath( octetLock_t* objLock );
+
+    // LockRequest
+    //
+    // One of several locks to be acquired together (see acquireAll),
+    // along with the parts of its policy that matter.
+    struct LockRequest {
+        octetLock_t* lock;
+        bool write;          // (Always set if the lock isn't read-shared.)
+        bool statistics;
+
+        // Scratch space for acquireBatch.
+        octetLockState_t prevState;
+    };
+
+    template <typename Policy>
+    inline LockRequest makeRequest( octetLock_t* objLock, bool write )
+    {
+        LockRequest request = { objLock, write || ! Policy::readShared,
+                                Policy::statistics, 0 };
+        return request;
+    }
+
+    bool acquireBatch( LockRequest* requests, size_t n );
+
+    // Lock heat
+    //
+    // A lock that keeps changing owners is cheaper to hand over with
+    // an explicit release than with a ping and a response. So the slow
+    // paths keep track of how often each lock conflicts, and mark the
+    // hot ones as pessimistic. The heat lives in a table indexed by a
+    // hash of the lock's address (see octet.cpp); each entry is tagged
+    // with more bits of the hash, so that a lock never sees the heat of
+    // another lock that happens to share its entry.
+    const unsigned HEAT_TABLE_BITS = 16;
+    const unsigned HEAT_TABLE_SIZE = 1u << HEAT_TABLE_BITS;
+    const uint32_t HEAT_MASK       = 0xff;   // (The rest is the tag.)
+    const uint32_t PESSIMISTIC     = 0x80;   // (The rest of HEAT_MASK is the heat.)
+
+    extern std::atomic<uint32_t> lockHeat[HEAT_TABLE_SIZE];
+
+    // The top HEAT_TABLE_BITS of the hash pick the entry, and the next
+    //    24 bits are the tag.
+    inline uint64_t heatHash( const octetLock_t* objLock )
+    {
+        uint64_t addr = reinterpret_cast<uintptr_t>( objLock ) / sizeof(octetLock_t);
+        return addr * 0x9e3779b97f4a7c15ull;
+    }
+
+    inline std::atomic<uint32_t>& heatOf( const octetLock_t* objLock )
+    {
+        return lockHeat[ heatHash( objLock ) >> (64 - HEAT_TABLE_BITS) ];
+    }
+
+    inline uint32_t heatTag( const octetLock_t* objLock )
+    {
+        return static_cast<uint32_t>( heatHash( objLock ) >> (32 - HEAT_TABLE_BITS) ) & ~HEAT_MASK;
+    }
+
+    // Whether the lock is pessimistic (rather than whatever else shares
+    //    its entry).
+    inline bool isPessimistic( const octetLock_t* objLock )
+    {
+        uint32_t entry = heatOf( objLock ).load( std::memory_order_relaxed );
+        return ( entry & PESSIMISTIC ) && ( entry & ~HEAT_MASK ) == heatTag( objLock );
+    }
+
 
     // writeBarrier
     //
@@ -170,30 +653,31 @@ namespace octet {
     //    (and hence whether locks *other* than the one being locked here
     //     were relinquished)
     //
+    template <typename Policy = DefaultPolicy>
     inline bool writeBarrier( octetLock_t* objLock )
     {
-#if STATISTICS
-        ++writeBarriers;
-#endif
+        if ( Policy::statistics ) {
+            bump( myThreadInfo->stats_.writeBarriers );
+        }
 
-        octetLockState_t goalState = WREX(myThreadInfo);
+        octetLockState_t goalState = MY_WREX;
 
         // Memory order: if we find the value we're looking for, it could only
         //    be this thread who wrote it, so there are no cross-thread memory
         //    issues. If we don't see the value we're looking for, the CAS in
         //    the slow path will make sure we will get up-to-date data.
         octetLockState_t curState =
-            objLock->load( MEM_ORD( std::memory_order_relaxed ) );
+            loadLock( objLock, Policy::order( std::memory_order_relaxed ) );
 
         if ( curState != goalState)  {
-            TRACE("Thread 0x%x on slow path to write-lock 0x%x\n",
-                  myThreadInfo, objLock);
+            PTRACE(Policy, "Thread 0x%x on slow path to write-lock 0x%x\n",
+                   myThreadInfo, objLock);
 
-            return writeSlowPath( objLock );
+            return writeSlowPath<Policy>( objLock );
         }
 
-        TRACE("Thread 0x%x took fast path to write-lock 0x%x\n",
-              myThreadInfo, objLock);
+        PTRACE(Policy, "Thread 0x%x took fast path to write-lock 0x%x\n",
+               myThreadInfo, objLock);
 
         // The fast path never grants any requests from other threads.
         return false;
@@ -208,58 +692,166 @@ namespace octet {
     //    (and hence whether locks *other* than the one being locked here
     //     were relinquished)
     //
-    inline bool readBarrier( octetLock_t* objLock )
+    template <typename Policy>
+    inline bool readBarrier( octetLock_t* objLock, std::true_type /* readShared */ )
     {
-
-#if READSHARED
-
-#if STATISTICS
-        ++readBarriers;
-#endif
+        if ( Policy::statistics ) {
+            bump( myThreadInfo->stats_.readBarriers );
+        }
 
         // Memory order: if we find our own thread in the lock, it could only
         //    be this thread who wrote it, so there are no cross-thread memory
         //    issues. If we don't see the value we're looking for, the CAS in
         //    the slow path will make sure we will get up-to-date data.
         //
-        octetLockState_t curState = objLock->load();
+        octetLockState_t curState = loadLock( objLock );
 
-        if ( GET_TID(curState) != myThreadInfo ) {
+        if ( ! OWNED_BY_ME(curState) ) {
 
-            if ( curState == RDSH ) {
+            if ( IS_RDSH(curState) && (curState & myThreadInfo->readerBit_) ) {
 
                 // Memory order:
                 //    On the other hand, if we see RdSh, it could have been written
                 //    by another thread. We don't have to take the full slow path,
                 //    but we do want to make sure that we see any changes to the data
-                //    that happened-before that thread switched the data to RdSh
+                //    that happened-before that thread switched the data to RdSh.
+                //    (Our bit might have been set by a different thread sharing
+                //    the same bit, so we can't assume we've synchronized already.)
 
                 std::atomic_thread_fence( std::memory_order_acquire );
 
             } else {
 
-                TRACE("Thread 0x%x on slow path to read-lock 0x%x\n",
-                      myThreadInfo, objLock);
+                PTRACE(Policy, "Thread 0x%x on slow path to read-lock 0x%x\n",
+                       myThreadInfo, objLock);
 
-                return readSlowPath( objLock );
+                return readSlowPath<Policy>( objLock );
 
             }
         }
 
-        TRACE("Thread 0x%x took fast path to read-lock 0x%x\n",
-              myThreadInfo, objLock);
+        PTRACE(Policy, "Thread 0x%x took fast path to read-lock 0x%x\n",
+               myThreadInfo, objLock);
 
         // The fast path never grants any requests from other threads.
         return false;
+    }
 
-#else // READSHARED
-
+    template <typename Policy>
+    inline bool readBarrier( octetLock_t* objLock, std::false_type /* readShared */ )
+    {
         // If we don't distinguish between read locking and write locking,
         // then read and write barriers are the same.
-        return writeBarrier( objLock );
+        return writeBarrier<Policy>( objLock );
+    }
+
+    template <typename Policy = DefaultPolicy>
+    inline bool readBarrier( octetLock_t* objLock )
+    {
+        return readBarrier<Policy>( objLock,
+                                    std::integral_constant<bool, Policy::readShared>() );
+    }
+
+
+
+    // holds, alreadyHeld
+    //
+    //  The fast path of read/writeBarrier: whether we already hold
+    //    the lock in a suitable mode. (alreadyHeld also counts it as
+    //    a barrier, if the request asks for statistics.) Requests
+    //    don't carry their lock's policy, so they use the default
+    //    ordering, as the rest of acquireBatch does.
+    //
+    template <typename Policy = DefaultPolicy>
+    inline bool holds( octetLock_t* objLock, bool write )
+    {
+        // Memory order: see writeBarrier and readBarrier.
+        if ( write ) {
+            return loadLock( objLock, Policy::order( std::memory_order_relaxed ) ) ==
+                   MY_WREX;
+        }
+
+        octetLockState_t curState = loadLock( objLock );
+
+        if ( OWNED_BY_ME(curState) ) return true;
+
+        if ( IS_RDSH(curState) && (curState & myThreadInfo->readerBit_) ) {
+            std::atomic_thread_fence( std::memory_order_acquire );
+            return true;
+        }
+
+        return false;
+    }
+
+    inline bool alreadyHeld( const LockRequest& request )
+    {
+        if ( request.statistics ) {
+            bump( request.write ? myThreadInfo->stats_.writeBarriers
+                                : myThreadInfo->stats_.readBarriers );
+        }
+
+        return holds( request.lock, request.write );
+    }
+
+    // acquireAll
+    //
+    //  Locks all the requested locks. If more than one needs the slow
+    //    path, then (on a multiprocessor) they're acquired together:
+    //    acquireBatch makes them all INTERMEDIATE, pings each of their
+    //    owners just once, and then waits for all the responses, so it
+    //    costs about one round trip rather than one per lock.
+    //
+    //  (May reorder the requests.)
+    //
+    //  Returns whether we lost any of these locks along the way (so
+    //    that the caller needs to try again).
+    //
+    inline bool acquireAll( LockRequest* requests, size_t n )
+    {
+        bool allHeld = true;
+        for (size_t i = 0; i < n; ++i) {
+            allHeld &= alreadyHeld( requests[i] );
+        }
+
+        return allHeld ? false : acquireBatch( requests, n );
+    }
+
+    // releaseLock
+    //
+    //  Says we're done with the lock for now. If the lock is pessimistic
+    //    (hot), it's actually released, so that the next thread to want it
+    //    can just take it. Otherwise, we keep it (so we can use it again
+    //    without synchronizing, as usual), and this is just a load.
+    //
+    inline void releaseLock( octetLock_t* objLock )
+    {
+        if ( isPessimistic( objLock ) ) {
+            releaseSlowPath( objLock );
+        }
+    }
 
-#endif // READSHARED
+    // poll
+    //
+    //  A safe point cheap enough for inner (and spin) loops: grants any
+    //    pending requests, like yield(), but if there aren't any, it's
+    //    just two loads (where yield() is an atomic read-modify-write).
+    //
+    //  Returns whether we granted any requests (and so may have lost locks).
+    //
+    inline bool poll()
+    {
+        // Memory order: if we miss a request that's just arrived, we'll
+        //    see it next time; if we see one, handleRequests synchronizes.
+        octetCount_t requests  = myThreadInfo->requests_.load( MEM_ORD( std::memory_order_relaxed ) );
+        octetCount_t responses = myThreadInfo->responses_.load( MEM_ORD( std::memory_order_relaxed ) );
+
+        // (Both counts are in the high bits; the low bits are flags.)
+        if ( ((requests ^ responses) & ~static_cast<octetCount_t>( 1 )) == 0 ) {
+            return false;
+        }
 
+        myThreadInfo->handleRequests( false );
+        return true;
     }
 
 
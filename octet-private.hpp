@@ -4,13 +4,19 @@
  * Locks modeled on the "Octet" barriers of Bond et al.
  *    "OCTET: Capturing and Controlling Cross-Thread Dependencies Efficiently"
  *
- * Utility template definitions that act on octet::Lock objects (and
+ * Utility template definitions that act on octet::BasicLock objects (and
  *    hence cannot be defined in octet-core.hpp).
  *
  * Author: Christopher A. Stone <stone@cs.hmc.edu>
  *
  */
 
+#include <chrono>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <thread>
 #include <utility>
 
 namespace octet {
@@ -20,10 +26,17 @@ namespace octet {
     // Helper functions to grab n locks
     ////////////////////////////////////////////
 
-    template <typename ...Tail>
-    void lock(Lock& l1, bool lockForWriting, Tail&&... tail);
+    template <typename Policy, typename ...Tail>
+    void lock(BasicLock<Policy>& l1, bool lockForWriting, Tail&&... tail);
+
+    template <typename Policy, bool LockInHighHalf, typename ...Tail>
+    void lock(BasicIntrusiveLock<Policy, LockInHighHalf> l1, bool lockForWriting,
+              Tail&&... tail);
 
-    // References consulted:
+    template <typename Iterator>
+    void lock(Iterator first, Iterator last);
+
+    // References consulted (for the variadic templates):
     // (1) LLVM library code
     //   http://llvm.org/svn/llvm-project/libcxx/trunk/include/mutex
     // particularly std::try_lock and std::lock.
@@ -33,45 +46,36 @@ namespace octet {
     // (3) Lippmann pp. 701-706
 
 
-    // WARNING: the return value is (mostly) backwards from pthreads try_lock.
-    // Lock acquisitional always succeeds (eventually); the question is whether
-    //    we were interrupted (lost *other* locks) in the mean time.
-
-    template <typename... Args>
-    inline bool trylockThem() {
-        // No locking to do => no interruptions.
-        return false;
-    }
-
-    inline bool trylockOne(Lock& l1, bool lockForWriting)
-    {
-        if (lockForWriting) {
-            TRACE("Thread 0x%x about to write-lock 0x%x\n", myThreadInfo, &l1);
-            return l1.writeLock();
-        } else {
-            TRACE("Thread 0x%x about to read-lock 0x%x\n", myThreadInfo, &l1);
-            return l1.readLock();
-        }
-    }
+    // fillRequests
+    //
+    //    Turns lock(...)'s arguments into an array of LockRequests.
+    //
+    inline void fillRequests(LockRequest*) {}
 
-    template <typename... Args>
-    inline bool trylockThem(Lock& l1, const bool& lockForWriting, Args&&... args)
+    template <typename Lockable, typename... Args>
+    inline void fillRequests(LockRequest* requests,
+                             Lockable&& l1, const bool& lockForWriting, Args&&... args)
     {
-        bool restart = trylockOne(l1, lockForWriting);
-
-        restart |= trylockThem(std::forward<Args>(args)...);
-
-        return restart;
+        *requests = l1.request(lockForWriting);
+        fillRequests(requests + 1, std::forward<Args>(args)...);
     }
 
     const int OCTET_BACKOFF_RETRIES = 5;
     const int OCTET_BACKOFF_EXPLIMIT = 13;
 
+    // lockRequests
+    //
+    //    Acquires all the requested locks, trying again (with
+    //    exponential backoff, if it keeps happening) whenever we
+    //    lost one of them in the process.
+    //
+    //    If checked is set, the caller has already tried the fast
+    //    path (see acquireAll), so we go straight to the slow path.
+    //
     // Note: only guarantees that all the given locks are locked.
     //       Does not say whether we might have lost other locks
     //       in the process.
-    template <typename ...Tail>
-    void lock(Lock& l1, bool lockForWriting, Tail&&... tail)
+    inline void lockRequests(LockRequest* requests, size_t n, bool checked = false)
     {
         bool restart;
         size_t retries = 0;
@@ -79,38 +83,264 @@ namespace octet {
         const int MAX_BACKOFF = BACKOFF_RETRIES + OCTET_BACKOFF_EXPLIMIT;
         int us = 1;
 
-        // The restart flag tells us whether we relinquished any locks in the
-        //   process of acquiring these three locks.
-        // This is a very coarse criterion. Maybe we lost some lock from
-        //   a previous iteration (that we don't care about any more). Or
-        //   maybe we lost the first two locks in the process of acquiring
-        //   the third.
-        // Fortunately, if we lost a lock we don't care about (which is
-        //   the more likely alternative in the absence of high contention),
-        //   the next loop will take 3 straight fast-paths and succeed almost
-        //   immediately.
+        // The restart flag tells us whether we relinquished any of these
+        //   locks in the process of acquiring the rest. If so, the next
+        //   round re-acquires just those (the rest take the fast path).
+        // If we lost a lock we don't care about, no problem.
 
         do {
-            // If we lost locks while waiting for the first, we don't care.
-            trylockOne(l1, lockForWriting);
-            // And if we lost locks while getting the rest, we might.
-            restart = trylockThem(std::forward<Tail>(tail)...);
+            restart = checked ? acquireBatch(requests, n) : acquireAll(requests, n);
+            checked = false;
 
             if ( restart ) {
                 ++retries;
+                bump( myThreadInfo->stats_.lockRestarts );
 
                 if (retries > BACKOFF_RETRIES) {
 
                     if (retries < MAX_BACKOFF) us *= 2;
 
-                    myThreadInfo->handleRequests( true );
+                    BlockedScope blocked;
                     std::this_thread::sleep_for(std::chrono::microseconds(us));
-                    myThreadInfo->unblock();
                 }
             }
         } while (restart);
     }
 
-}
+    template <typename Policy, typename ...Tail>
+    void lock(BasicLock<Policy>& l1, bool lockForWriting, Tail&&... tail)
+    {
+        LockRequest requests[1 + sizeof...(Tail) / 2];
+
+        fillRequests(requests, l1, lockForWriting, std::forward<Tail>(tail)...);
+
+        lockRequests(requests, 1 + sizeof...(Tail) / 2);
+    }
+
+    template <typename Policy, bool LockInHighHalf, typename ...Tail>
+    void lock(BasicIntrusiveLock<Policy, LockInHighHalf> l1, bool lockForWriting,
+              Tail&&... tail)
+    {
+        LockRequest requests[1 + sizeof...(Tail) / 2];
+
+        fillRequests(requests, l1, lockForWriting, std::forward<Tail>(tail)...);
+
+        lockRequests(requests, 1 + sizeof...(Tail) / 2);
+    }
+
+    template <size_t N>
+    class LockScope {
+
+        LockRequest requests_[N];
+        bool active_;
 
+    public:
+        template <typename Lockable, typename ...Tail>
+        LockScope(Lockable&& l1, bool lockForWriting, Tail&&... tail)
+        : active_( true )
+        {
+            static_assert( 2 + sizeof...(Tail) == 2 * N, "LockScope<N> takes N locks" );
 
+            fillRequests(requests_, std::forward<Lockable>(l1), lockForWriting,
+                         std::forward<Tail>(tail)...);
+
+            lockRequests(requests_, N);
+        }
+
+        LockScope(LockScope&& other)
+        : active_( other.active_ )
+        {
+            for (size_t i = 0; i < N; ++i) requests_[i] = other.requests_[i];
+            other.active_ = false;
+        }
+
+        ~LockScope() { if ( active_ ) leave(); }
+
+        LockScope(const LockScope&) = delete;
+        LockScope& operator=(const LockScope&) = delete;
+
+        // Ends the scope early.
+        void leave()
+        {
+            active_ = false;
+            for (size_t i = 0; i < N; ++i) releaseLock(requests_[i].lock);
+        }
+    };
+
+    template <typename ...Tail>
+    LockScope<sizeof...(Tail) / 2> lockScope(Tail&&... tail)
+    {
+        return LockScope<sizeof...(Tail) / 2>(std::forward<Tail>(tail)...);
+    }
+
+    // Lock sets up to this size are kept on the stack.
+    const size_t OCTET_STACK_REQUESTS = 16;
+
+    // lockRange
+    //
+    //    Acquires a runtime-sized set of locks: makeRequest turns each
+    //    element of [first, last) into a LockRequest.
+    //
+    template <typename Iterator, typename MakeRequest>
+    void lockRange(Iterator first, Iterator last, MakeRequest makeRequest)
+    {
+        size_t n = std::distance(first, last);
+
+        if (n <= OCTET_STACK_REQUESTS) {
+            LockRequest requests[OCTET_STACK_REQUESTS];
+
+            size_t i = 0;
+            for (Iterator it = first; it != last; ++it) {
+                requests[i++] = makeRequest(*it);
+            }
+
+            lockRequests(requests, n);
+            return;
+        }
+
+        // Too many for the stack. We only need the array if something
+        //    needs the slow path, so check first.
+        bool allHeld = true;
+        for (Iterator it = first; it != last; ++it) {
+            allHeld &= alreadyHeld(makeRequest(*it));
+        }
+        if (allHeld) return;
+
+        std::unique_ptr<LockRequest[]> requests(new LockRequest[n]);
+
+        size_t i = 0;
+        for (Iterator it = first; it != last; ++it) {
+            requests[i++] = makeRequest(*it);
+        }
+
+        lockRequests(requests.get(), n, true);
+    }
+
+    template <typename Iterator>
+    void lock(Iterator first, Iterator last)
+    {
+        using Pair = typename std::iterator_traits<Iterator>::value_type;
+
+        lockRange(first, last,
+                  [](const Pair& p) { return p.first->request(p.second); });
+    }
+
+
+    ////////////////////////////////////////////
+    // Blocking calls
+    ////////////////////////////////////////////
+
+    // BlockedCall
+    //
+    //    A BlockedScope that says on the way out (even if f throws)
+    //    whether we may have lost locks.
+    //
+    class BlockedCall : public BlockedScope {
+        bool* lost_;
+
+    public:
+        explicit BlockedCall( bool* lost ) : lost_( lost ) {}
+
+        ~BlockedCall()
+        {
+            bool lostAny = leave();
+            if ( lost_ ) *lost_ = lostAny;
+        }
+    };
+
+    template <typename F>
+    auto blocking( F&& f, bool* lost ) -> decltype( f() )
+    {
+        BlockedCall blocked( lost );
+        return f();
+    }
+
+
+    ////////////////////////////////////////////
+    // Lock tables
+    ////////////////////////////////////////////
+
+    template <typename Policy>
+    BasicLockTable<Policy>::BasicLockTable( size_t stripes )
+    {
+        unsigned bits = 0;
+        while ( bits < 63 && (static_cast<size_t>(1) << bits) < stripes ) ++bits;
+
+        mask_ = (static_cast<size_t>(1) << bits) - 1;
+        shift_ = bits ? 64 - bits : 0;
+
+        storage_.reset( new char[ (mask_ + 2) * sizeof(Stripe) ] );
+
+        uintptr_t aligned = ( reinterpret_cast<uintptr_t>( storage_.get() ) + CACHE_LINE - 1 )
+                            & ~static_cast<uintptr_t>( CACHE_LINE - 1 );
+        stripes_ = reinterpret_cast<Stripe*>( aligned );
+
+        for (size_t i = 0; i <= mask_; ++i) {
+            new ( &stripes_[i] ) Stripe();
+        }
+    }
+
+    template <typename Policy>
+    BasicLockTable<Policy>::~BasicLockTable()
+    {
+        for (size_t i = 0; i <= mask_; ++i) {
+            stripes_[i].~Stripe();
+        }
+    }
+
+    // noteUser
+    //
+    //    Having just locked the stripe, counts a conflict if another
+    //    thread used it last (unless we were both just reading). The
+    //    fields are only written when they change, so a thread that
+    //    keeps using the same key doesn't touch the line.
+    //
+    template <typename Policy>
+    void BasicLockTable<Policy>::noteUser( Stripe& s, uintptr_t key, bool write )
+    {
+        OctetThreadInfo* lastUser = s.lastUser_.load( std::memory_order_relaxed );
+        uintptr_t lastKey = s.lastKey_.load( std::memory_order_relaxed );
+        bool lastWrite = s.lastWrite_.load( std::memory_order_relaxed );
+
+        if ( lastUser == myThreadInfo && lastKey == key && lastWrite == write ) return;
+
+        if ( lastUser != nullptr && lastUser != myThreadInfo && (write || lastWrite) ) {
+            (lastKey == key ? s.trueConflicts_ : s.falseConflicts_)
+                .fetch_add( 1, std::memory_order_relaxed );
+        }
+
+        s.lastKey_.store( key, std::memory_order_relaxed );
+        s.lastUser_.store( myThreadInfo, std::memory_order_relaxed );
+        s.lastWrite_.store( write, std::memory_order_relaxed );
+    }
+
+    template <typename Policy>
+    template <typename Iterator>
+    void BasicLockTable<Policy>::lock( Iterator first, Iterator last )
+    {
+        using Pair = typename std::iterator_traits<Iterator>::value_type;
+
+        lockRange(first, last,
+                  [this](const Pair& p) { return forKey(p.first).request(p.second); });
+
+        if ( Policy::statistics ) {
+            for (Iterator it = first; it != last; ++it) {
+                noteUser( stripes_[ stripeIndex( it->first ) ], it->first, it->second );
+            }
+        }
+    }
+
+    template <typename Policy>
+    LockTableStatistics BasicLockTable<Policy>::getStatistics() const
+    {
+        LockTableStatistics stats = { stripes(), stripes() * sizeof(Stripe), 0, 0 };
+
+        for (size_t i = 0; i <= mask_; ++i) {
+            stats.trueConflicts  += stripes_[i].trueConflicts_.load( std::memory_order_relaxed );
+            stats.falseConflicts += stripes_[i].falseConflicts_.load( std::memory_order_relaxed );
+        }
+
+        return stats;
+    }
+
+}
@@ -9,16 +9,31 @@
  */
 
 #include <cassert>
+#include <cerrno>
+#include <csignal>
 #include <cstdarg>
 #include <cstdlib>
 #include <cstdio>
 #include <iostream>
+#include <limits>
 #include <atomic>
-#include <unordered_set>
-#include <vector>
 #include <utility>
 #include <algorithm>
+#include <chrono>
+#include <functional>
+#include <map>
 #include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if PARKING
+#include <climits>
+#include <linux/futex.h>
+#endif
 
 #include "octet.hpp"
 
@@ -32,53 +47,238 @@ namespace octet {
     ////////////////////////////////////////////
 
     // When a thread wants to write to a read-shared object,
-    // it has to get permission from all readers. Since we don't
-    // specifically track readers for each object, we conservatively
-    // get permission from *all* running threads. We thus keep a
-    // mutex-protected set representing the current threads, or at
-    // least the OctetThreadInfo objects for the current threads.
-
-#if READSHARED
-    std::mutex activeThreadsMutex;
-    std::unordered_set<OctetThreadInfo*> activeThreads;
+    // it has to get permission from all readers. The lock only
+    // records a (possibly aliased) set of reader bits, so we need
+    // to be able to find the threads using those bits.
+    //
+    // Each running thread occupies one slot of a fixed-size array
+    // (the registry), and its reader bit is determined by its slot
+    // number. Slots are claimed and released with atomic operations,
+    // so writers can scan the registry without taking a lock.
+    //
+    // Slots are reused lowest-first, so that the threads that are
+    // actually running spread over as many distinct bits as possible.
+    //
+    // The registry also recycles OctetThreadInfo objects. We can't free
+    // them, because locks may still point at them long after the thread
+    // is gone. Instead, each slot keeps its OctetThreadInfo forever, and
+    // the next thread (or context) to claim the slot takes it over, along
+    // with any locks still owned by the previous one; see attachContext.
+    // So memory use is bounded by the number of simultaneous contexts,
+    // not the number ever created.
+
+#ifndef OCTET_MAX_THREADS
+#define OCTET_MAX_THREADS 1024
 #endif
 
+    const unsigned MAX_THREADS = OCTET_MAX_THREADS;
 
-    void initPerthread()
-    {
-        // Double-check that this is only being called once per pthread
-        assert(myThreadInfo == nullptr);
-        myThreadInfo = new OctetThreadInfo;
+    struct ThreadSlot {
+        std::atomic<bool> inUse_;
+        std::atomic<OctetThreadInfo*> info_;  // Allocated on first use.
+    };
+
+    ThreadSlot threadSlots[MAX_THREADS];
 
-#if READSHARED
-        // Add this thread to the set of active threads
-        std::lock_guard<std::mutex> lockTheSet(activeThreadsMutex);
-        activeThreads.insert( myThreadInfo );
+    // One more than the highest slot ever claimed; scans can stop here.
+    std::atomic<unsigned> slotsUsed(0);
+
+#if OCTET_COMPACT_LOCKS
+    // Compact lock states name their owner by id_ (see octet-core.hpp):
+    //    noThreadInfo() is 1, and the OctetThreadInfo in slot i is i + 2.
+    //    Like the slots, entries never change once set.
+    static_assert( MAX_THREADS + 2 <= (1u << 30),
+                   "OCTET_MAX_THREADS too large for compact locks" );
+
+    std::atomic<OctetThreadInfo*> threadsById[MAX_THREADS + 2];
+#endif
+
+    // setId
+    //
+    // Gives a new OctetThreadInfo its id_ (and makes it findable from
+    //    compact lock states), before it can appear in any lock.
+    static void setId( OctetThreadInfo* info, uint32_t id )
+    {
+        info->id_ = id;
+#if OCTET_COMPACT_LOCKS
+        threadsById[id].store( info, std::memory_order_release );
 #endif
     }
 
-    void shutdownPerthread()
+
+    ////////////////////////////////////////////
+    // Contexts
+    ////////////////////////////////////////////
+
+    // A context is just an OctetThreadInfo that isn't permanently tied
+    //    to a thread. At any time, at most one thread acts for a context:
+    //    either the thread it's attached to, or a thread calling respondFor.
+    //    The attached_ flag says whether someone is.
+
+    Context* createContext()
     {
+        // Claim the first free slot in the registry.
+        //
+        // Memory order: the compare_exchange synchronizes with the
+        //    previous user of the slot giving it up, so we see everything
+        //    that context did to the data it still has locked.
+        unsigned slot = 0;
+        bool expected = false;
+
+        while ( ! threadSlots[slot].inUse_.compare_exchange_strong( expected, true ) ) {
+            expected = false;
+            if ( ++slot == MAX_THREADS ) {
+                atomic_printf("octet: more than %u simultaneous contexts "
+                              "(increase OCTET_MAX_THREADS)\n", MAX_THREADS);
+                std::abort();
+            }
+        }
 
-        // Mark this thread as blocked and handle any pending requests.
-        myThreadInfo->handleRequests( true );
+        OctetThreadInfo* info = threadSlots[slot].info_.load();
+
+        if ( info == nullptr ) {
+            // A brand-new slot. The OctetThreadInfo starts out blocked,
+            //    just like one left behind by a destroyed context.
+            info = new OctetThreadInfo( true );
+            info->slot_ = slot;
+            info->readerBit_ = READER_BIT( slot );
+            setId( info, slot + 2 );
+            threadSlots[slot].info_.store( info );
+
+            unsigned used = slotsUsed.load();
+            while ( used <= slot && ! slotsUsed.compare_exchange_weak( used, slot + 1 ) ) {
+                // Try again (used was updated by compare_exchange_weak)
+            }
+        }
+
+        // The new context stays blocked until it's first attached, so
+        //    any locks the previous context still held remain free for
+        //    the taking.
+        return info;
+    }
+
+    void attachContext( Context* ctx )
+    {
+        assert( ctx != nullptr );
+        assert( myThreadInfo == nullptr );
 
-#if READSHARED
-        // Remove me from the set of active threads
-        std::lock_guard<std::mutex> lockTheSet(activeThreadsMutex);
-        assert( activeThreads.find(myThreadInfo) != activeThreads.end() );
-        activeThreads.erase( myThreadInfo );
+        // Wait out anyone responding on the context's behalf.
+        //
+        // Memory order: synchronizes with the detach (or respondFor) that
+        //    last released the context, so we see everything it did.
+        bool expected = false;
+        while ( ! ctx->attached_.compare_exchange_weak( expected, true ) ) {
+            expected = false;
+            std::this_thread::yield();
+        }
+
+        myThreadInfo = ctx;
+#if OCTET_COMPACT_LOCKS
+        myWrEx = WREX(ctx);
+#endif
+#ifdef __linux__
+        ctx->tid_.store( static_cast<int>( syscall( SYS_gettid ) ),
+                         std::memory_order_relaxed );
+#endif
+
+        // If the context is new (or reused), any locks the previous user
+        //    of its slot held are now ours. That's fine: it can't use them
+        //    any more, and anyone who wanted them while the slot was empty
+        //    could take them without waiting. From now on, they'll have
+        //    to ask us.
+        if ( ctx->requests_.load( MEM_ORD( std::memory_order_relaxed ) ) & 0x1 ) {
+            ctx->unblock();
+        }
+    }
+
+    Context* detachContext()
+    {
+        Context* ctx = myThreadInfo;
+        assert( ctx != nullptr );
+
+        // Switching contexts is a safe point, so we might as well
+        //    grant anything that's already been requested. (We don't
+        //    block, though; the context keeps the rest of its locks.)
+        ctx->handleRequests( false );
+
+        ctx->tid_.store( 0, std::memory_order_relaxed );
+        myThreadInfo = nullptr;
+#if OCTET_COMPACT_LOCKS
+        myWrEx = 0;
 #endif
+        ctx->attached_.store( false MEM_ORD(, std::memory_order_release) );
+
+        return ctx;
+    }
+
+    bool respondFor( Context* ctx )
+    {
+        assert( ctx != nullptr );
 
+        bool expected = false;
+        if ( ! ctx->attached_.compare_exchange_strong( expected, true ) ) {
+            // Someone else is acting for the context (and will respond).
+            return false;
+        }
 
-        // We leak a little bit of memory (*myThreadInfo)
-        //   because there may still be many objects owned
-        //   by us.
+        if ( ! (ctx->requests_.load( MEM_ORD( std::memory_order_relaxed ) ) & 0x1) ) {
+            ctx->handleRequests( false );
+        }
 
+        ctx->attached_.store( false MEM_ORD(, std::memory_order_release) );
+        return true;
+    }
+
+    void destroyContext( Context* ctx )
+    {
+        assert( ctx != nullptr );
+
+        bool expected = false;
+        while ( ! ctx->attached_.compare_exchange_weak( expected, true ) ) {
+            expected = false;
+            std::this_thread::yield();
+        }
+
+        // Mark the context as blocked and handle any pending requests.
+        if ( ! (ctx->requests_.load( MEM_ORD( std::memory_order_relaxed ) ) & 0x1) ) {
+            ctx->handleRequests( true );
+        }
+
+        ctx->attached_.store( false );
+
+        // Give up our slot (and our OctetThreadInfo) for the next context.
+        //    Anyone who still finds us in the registry, or in a lock,
+        //    will see that we're blocked and not wait for us.
+        //
+        // Memory order: see createContext.
+        assert( threadSlots[ctx->slot_].inUse_.load() );
+        threadSlots[ctx->slot_].inUse_.store( false );
+    }
+
+
+    void initPerthread()
+    {
+        // Double-check that this is only being called once per pthread
+        assert(myThreadInfo == nullptr);
+
+        attachContext( createContext() );
+    }
+
+    void shutdownPerthread()
+    {
+        // (Locks with a Statistics policy are otherwise only reported
+        //    through getStatistics.)
 #if STATISTICS
-        atomic_printf("Thread 0x%x: %d/%d slow writes and %d/%d slow reads\n",
-                      myThreadInfo, slowWrites, writeBarriers, slowReads, readBarriers);
+        const ThreadStats& stats = myThreadInfo->stats_;
+        atomic_printf("Thread 0x%x: %llu/%llu slow writes and %llu/%llu slow reads\n",
+                      myThreadInfo,
+                      (unsigned long long) stats.slowWrites.load(),
+                      (unsigned long long) stats.writeBarriers.load(),
+                      (unsigned long long) stats.slowReads.load(),
+                      (unsigned long long) stats.readBarriers.load());
 #endif
+
+        destroyContext( detachContext() );
     }
 
     ////////////////////////////////////////////
@@ -88,22 +288,23 @@ namespace octet {
     // Clang 3.2 (on the mac) doesn't support the thread_local qualifier.
     //   (Apparently 3.3 will)
 
-    // WARNING: if we ever move to thread pools, then we have to start worrying
-    // about keeping track of per worker-thread info rather than per-pthread info!
+    // myThreadInfo is the context currently attached to this thread. Usually
+    // that's the context created by initPerthread, but a thread pool or
+    // user-level scheduler can move contexts between threads (see
+    // attachContext and detachContext).
 
     // It's important to keep the data on the heap, rather than in thread-local
     // memory, because we want it to persist beyond the termination of the thread.
 
     __thread OctetThreadInfo* myThreadInfo = nullptr;
 
-
-#if STATISTICS
-    __thread size_t writeBarriers = 0;
-    __thread size_t slowWrites = 0;
-    __thread size_t readBarriers = 0;
-    __thread size_t slowReads = 0;
+#if OCTET_COMPACT_LOCKS
+    // 0 is never anyone's WrEx state (see OctetThreadInfo::id_).
+    __thread octetLockState_t myWrEx = 0;
 #endif
 
+    __thread volatile sig_atomic_t asyncSafe = 0;
+
     ///////////////////////////////
     // For Debugging
     ///////////////////////////////
@@ -126,10 +327,36 @@ namespace octet {
     // The OctetThreadInfo class
     ////////////////////////////////////////////
 
+    // Where the counts start (with the flag bit cleared).
+    const octetCount_t COUNT_START =
+        static_cast<octetCount_t>( OCTET_COUNT_START ) & ~static_cast<octetCount_t>( 1 );
+
+    // countOf
+    //
+    //    Strips the flag bit from a requests_ or responses_ value.
+    //
+    static inline octetCount_t countOf( octetCount_t word )
+    {
+        return word & ~static_cast<octetCount_t>( 1 );
+    }
+
+    // countReached
+    //
+    //    Whether count has caught up with goal. The counters wrap around,
+    //    so this is modular: it's right as long as the two are less than
+    //    half the counter range apart (i.e., always, in practice).
+    //
+    static inline bool countReached( octetCount_t count, octetCount_t goal )
+    {
+        return count - goal <= std::numeric_limits<octetCount_t>::max() / 2;
+    }
+
     // Methods used by the *owner* of the OctetThreadInfo
 
     OctetThreadInfo::OctetThreadInfo( bool startBlocked )
-    : requests_(startBlocked), responses_(0)
+    : requests_(COUNT_START | startBlocked), responses_(COUNT_START),
+      readerBit_(0), slot_(0), id_(0),
+      attached_(false), tid_(0), profile_(nullptr)
     {
         // Sanity checking
         assert( requests_.is_lock_free() );
@@ -139,37 +366,721 @@ namespace octet {
     void OctetThreadInfo::handleRequests( bool shouldBlock )
     {
         // Recall:fetch_or returns the old (hopefully unblocked) value
-        uint32_t req = requests_.fetch_or( shouldBlock
-                                          MEM_ORD(, std::memory_order_acq_rel ) );
+        octetCount_t req = requests_.fetch_or( shouldBlock
+                                              MEM_ORD(, std::memory_order_acq_rel ) );
 
         // We shouldn't call handleRequests while the thread is blocked.
         //    (unblock() would be more appropriate)
         assert ( ! (req & 0x1) );
 
-        uint32_t request_count = req >> 1;
+        respond( countOf( req ) );
+    }
+
+    void OctetThreadInfo::unblock()
+    {
+        octetCount_t req = requests_.fetch_and( ~static_cast<octetCount_t>( 1 )
+                                                MEM_ORD(, std::memory_order_acq_rel) );
 
+        // Any requests that arrived while we were blocked were implicitly
+        //    granted. Acknowledge them, so that a slow path that blocked
+        //    while waiting can tell that it lost locks.
+        respond( countOf( req ) );
+    }
+
+#if PARKING
+
+    // The futex calls work on any 32-bit word (in practice, the low half
+    //    of a lock or of a response count; see futexWord below).
+
+    static void futexWait( void* word, uint32_t expected,
+                           const struct timespec* timeout = nullptr )
+    {
+        syscall( SYS_futex, static_cast<uint32_t*>(word),
+                 FUTEX_WAIT_PRIVATE, expected, timeout, nullptr, 0 );
+    }
+
+    static void futexWake( void* word )
+    {
+        syscall( SYS_futex, static_cast<uint32_t*>(word),
+                 FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0 );
+    }
+
+    // futexWord
+    //
+    //    The low 32 bits of an atomic word. Since the flag bits we sleep
+    //    on are at the bottom, and counts only move forward, these bits
+    //    change whenever anything we'd want to wake up for does.
+    //
+    template <typename T>
+    static void* futexWord( std::atomic<T>* word )
+    {
+        uint32_t* halves = reinterpret_cast<uint32_t*>( word );
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        return halves + (sizeof(T) / sizeof(uint32_t) - 1);
+#else
+        return halves;
+#endif
+    }
+
+    //    A lock's state is a word of its own, except that an intrusive
+    //    lock's is half of the caller's word. (The kernel reads just that
+    //    half, but we only ever change it through the whole word.)
+    static void* futexWord( octetLock_t* objLock )
+    {
+        if ( ! isIntrusive( objLock ) ) return futexWord<octetLockState_t>( objLock );
+
+        uint32_t* halves = reinterpret_cast<uint32_t*>( intrusiveWord( objLock ) );
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        return halves + (intrusiveShift( objLock ) ? 0 : 1);
+#else
+        return halves + (intrusiveShift( objLock ) ? 1 : 0);
+#endif
+    }
+
+#endif // PARKING
+
+    void OctetThreadInfo::respond( octetCount_t request_count )
+    {
         // Memory order:
         //    Any threads waiting for this response are in a memory_order_acquire
         //    loop. By using release here, we ensure that any changes we made to
         //    data before giving up the lock happen-before the waiting thread
         //    sees the response.
+
+#if PARKING
+        // If there are no new requests, there's no one to wake up.
+        //    (Anyone who parks sets the low bit first, and waits for a count
+        //    we haven't reached yet.) This keeps the common case of yield()
+        //    down to a load.
+        if ( countOf( responses_.load( MEM_ORD( std::memory_order_relaxed ) ) ) == request_count ) {
+            return;
+        }
+
+        // The exchange tells us (atomically) whether anyone has parked.
+        octetCount_t prev = responses_.exchange( request_count
+                                                 MEM_ORD(, std::memory_order_release ) );
+
+        if ( prev & 0x1 ) {
+            futexWake( futexWord( &responses_ ) );
+        }
+#else
         responses_.store( request_count MEM_ORD(, std::memory_order_release ) );
+#endif
     }
 
-    void OctetThreadInfo::unblock()
+    ////////////////////////////////////////////
+    // Statistics
+    ////////////////////////////////////////////
+
+    // The statistics live in the OctetThreadInfo objects, which are never
+    //    freed (just recycled along with their registry slots), so adding
+    //    up every slot's counters covers exited threads too.
+
+    ThreadStats::ThreadStats()
+    {
+        // (std::atomic's default constructor leaves the value uninitialized.)
+        writeBarriers.store( 0 );
+        slowWrites.store( 0 );
+        readBarriers.store( 0 );
+        slowReads.store( 0 );
+        for ( auto& count : transitions ) count.store( 0 );
+        lockRestarts.store( 0 );
+        for ( auto& count : intermediateNs ) count.store( 0 );
+        for ( auto& count : awaitNs ) count.store( 0 );
+    }
+
+    // addStatistics
+    //
+    //    Adds one context's counts into a snapshot.
+    //
+    static void addStatistics( LockStatistics& total, const ThreadStats& stats )
+    {
+        const std::memory_order relaxed = std::memory_order_relaxed;
+
+        total.writeBarriers += stats.writeBarriers.load( relaxed );
+        total.slowWrites    += stats.slowWrites.load( relaxed );
+        total.readBarriers  += stats.readBarriers.load( relaxed );
+        total.slowReads     += stats.slowReads.load( relaxed );
+        total.lockRestarts  += stats.lockRestarts.load( relaxed );
+
+        for (unsigned i = 0; i < NUM_TRANSITIONS; ++i) {
+            total.transitions[i] += stats.transitions[i].load( relaxed );
+        }
+        for (unsigned i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+            total.intermediateNs[i] += stats.intermediateNs[i].load( relaxed );
+            total.awaitNs[i]        += stats.awaitNs[i].load( relaxed );
+        }
+    }
+
+    LockStatistics getStatistics()
+    {
+        LockStatistics total = LockStatistics();
+
+        unsigned used = slotsUsed.load();
+        for (unsigned slot = 0; slot < used; ++slot) {
+            OctetThreadInfo* info = threadSlots[slot].info_.load();
+            if ( info != nullptr ) {
+                addStatistics( total, info->stats_ );
+            }
+        }
+
+        return total;
+    }
+
+    LockStatistics getStatistics( const Context* ctx )
+    {
+        assert( ctx != nullptr );
+
+        LockStatistics total = LockStatistics();
+        addStatistics( total, ctx->stats_ );
+        return total;
+    }
+
+    const char* transitionName( Transition t )
+    {
+        switch ( t ) {
+            case WREX_TO_WREX: return "WrEx->WrEx";
+            case WREX_TO_RDEX: return "WrEx->RdEx";
+            case RDEX_TO_WREX: return "RdEx->WrEx";
+            case RDEX_TO_RDSH: return "RdEx->RdSh";
+            case RDSH_TO_WREX: return "RdSh->WrEx";
+            case RDSH_TO_RDSH: return "RdSh->RdSh";
+            case UPGRADE:      return "upgrade";
+            case RELEASED_TO_OWNED: return "released->owned";
+            default:           return "?";
+        }
+    }
+
+    // printHistogram
+    //
+    //    Prints the nonempty buckets, labeled by their lower bounds.
+    //
+    static void printHistogram( const char* title, const uint64_t* buckets )
+    {
+        char line[80 * HISTOGRAM_BUCKETS];
+        int len = snprintf( line, sizeof(line), "octet: %s (ns):", title );
+
+        for (unsigned i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+            if ( buckets[i] != 0 ) {
+                len += snprintf( line + len, sizeof(line) - len, "  %llu+ %llu",
+                                 i == 0 ? 0ull : 1ull << i,
+                                 (unsigned long long) buckets[i] );
+            }
+        }
+
+        atomic_printf( "%s\n", line );
+    }
+
+    void printStatistics( const LockStatistics& stats )
+    {
+        atomic_printf( "octet: %llu/%llu slow writes, %llu/%llu slow reads, "
+                       "%llu lock restarts\n",
+                       (unsigned long long) stats.slowWrites,
+                       (unsigned long long) stats.writeBarriers,
+                       (unsigned long long) stats.slowReads,
+                       (unsigned long long) stats.readBarriers,
+                       (unsigned long long) stats.lockRestarts );
+
+        char line[80 * NUM_TRANSITIONS];
+        int len = snprintf( line, sizeof(line), "octet: transitions:" );
+        for (unsigned i = 0; i < NUM_TRANSITIONS; ++i) {
+            len += snprintf( line + len, sizeof(line) - len, "  %s %llu",
+                             transitionName( static_cast<Transition>(i) ),
+                             (unsigned long long) stats.transitions[i] );
+        }
+        atomic_printf( "%s\n", line );
+
+        printHistogram( "waiting for INTERMEDIATE", stats.intermediateNs );
+        printHistogram( "waiting for responses", stats.awaitNs );
+    }
+
+    // The slow paths use these to record what they did, if their lock's
+    //    policy asks for it.
+
+    using statClock = std::chrono::steady_clock;
+
+    template <bool Statistics>
+    static inline statClock::time_point startTimer()
+    {
+        return Statistics ? statClock::now() : statClock::time_point();
+    }
+
+    template <bool Statistics>
+    static inline void recordWait( statCounter_t* histogram, statClock::time_point start )
+    {
+        if ( Statistics ) {
+            uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              statClock::now() - start ).count();
+
+            unsigned bucket = 0;
+            while ( ns > 1 && bucket + 1 < HISTOGRAM_BUCKETS ) {
+                ns >>= 1;
+                ++bucket;
+            }
+
+            bump( histogram[bucket] );
+        }
+    }
+
+    ////////////////////////////////////////////
+    // Lock heat
+    ////////////////////////////////////////////
+
+    // Each entry says which lock it belongs to (by its tag), whether that
+    //    lock is pessimistic, and how hot it is. A conflict (taking a lock
+    //    by pinging its owner) warms the lock's entry up; after
+    //    HOT_THRESHOLD net conflicts, the lock becomes pessimistic, and its
+    //    owners release it whenever they're done with it (see releaseLock).
+    //    A thread re-taking a lock that it released itself means the lock
+    //    isn't really shared any more, which cools the entry down; once
+    //    it's back to 0, the lock is biased again.
+    //
+    //    An entry with no heat is free for any lock to claim. If two locks
+    //    that share an entry both conflict, the one that has it keeps it
+    //    (the other's conflicts cool it down) until it goes cold. Either
+    //    way, the other lock just stays biased.
+    std::atomic<uint32_t> lockHeat[HEAT_TABLE_SIZE];
+
+    const unsigned HOT_THRESHOLD = 8;
+    const unsigned MAX_HEAT      = 16;
+
+    // adjustHeat
+    //
+    //    Records a conflict (or lack of one) for the given lock.
+    //
+    static void adjustHeat( const octetLock_t* objLock, bool conflict )
+    {
+        std::atomic<uint32_t>& entry = heatOf( objLock );
+        uint32_t tag = heatTag( objLock );
+
+        uint32_t cur = entry.load( std::memory_order_relaxed );
+        uint32_t next;
+
+        do {
+            uint32_t owner = cur & ~HEAT_MASK;
+            unsigned heat = cur & HEAT_MASK & ~PESSIMISTIC;
+            bool pessimistic = cur & PESSIMISTIC;
+
+            // (Don't write to a shared entry if nothing would change.)
+            if ( ! conflict && ( owner != tag || heat == 0 ) ) return;
+
+            if ( owner != tag && heat > 0 ) {
+                // Some other lock has the entry; wear it down.
+                if ( --heat == 0 ) pessimistic = false;
+            } else if ( conflict ) {
+                owner = tag;
+                if ( heat < MAX_HEAT ) ++heat;
+                if ( heat >= HOT_THRESHOLD ) pessimistic = true;
+            } else {
+                if ( --heat == 0 ) pessimistic = false;
+            }
+
+            next = owner | heat | (pessimistic ? PESSIMISTIC : 0);
+
+            if ( next == cur ) return;
+
+        } while ( ! entry.compare_exchange_weak( cur, next, std::memory_order_relaxed ) );
+    }
+
+    ////////////////////////////////////////////
+    // Profiling
+    ////////////////////////////////////////////
+
+    // If nonzero, each thread records one in every sampleInterval
+    //    slow-path transitions in its context's ProfileBuffer.
+    std::atomic<unsigned> sampleInterval(0);
+
+    // How many more transitions until this thread takes a sample.
+    __thread unsigned transitionsUntilSample = 0;
+
+    // The number of samples each context keeps (the most recent ones).
+    const unsigned PROFILE_BUFFER_SIZE = 1024;
+
+    // ProfileRecord
+    //
+    //    One sample. The owner of the buffer writes records while
+    //    reporting threads read them, so each record is protected by a
+    //    sequence number that's odd while the record is being written;
+    //    a reader discards the record if the number changed while it
+    //    was reading. (The new owner is always the buffer's context.)
+    //
+    struct ProfileRecord {
+        std::atomic<unsigned> seq_;
+        std::atomic<const octetLock_t*> lock_;
+        std::atomic<const OctetThreadInfo*> prevOwner_; // nullptr if RdSh
+        std::atomic<uint64_t> waitNs_;
+    };
+
+    struct ProfileBuffer {
+        std::atomic<uint64_t> recorded_;  // Samples ever taken.
+        ProfileRecord records_[PROFILE_BUFFER_SIZE];
+
+        ProfileBuffer()
+        {
+            recorded_.store( 0 );
+            for ( auto& rec : records_ ) rec.seq_.store( 0 );
+        }
+    };
+
+    void setProfileSampling( unsigned interval )
+    {
+        sampleInterval.store( interval, std::memory_order_relaxed );
+    }
+
+    // SampleTimer
+    //
+    //    Decides (when a slow path starts) whether to sample the
+    //    transition, and if so, when it started. With sampling off,
+    //    this is just one relaxed load.
+    //
+    struct SampleTimer {
+        bool sampling_;
+        statClock::time_point start_;
+
+        SampleTimer() : sampling_( false )
+        {
+            unsigned interval = sampleInterval.load( std::memory_order_relaxed );
+            if ( interval == 0 ) return;
+
+            if ( transitionsUntilSample == 0 || transitionsUntilSample > interval ) {
+                transitionsUntilSample = interval;
+            }
+            if ( --transitionsUntilSample == 0 ) {
+                sampling_ = true;
+                start_ = statClock::now();
+            }
+        }
+    };
+
+    // recordSample
+    //
+    //    Adds a sample to our context's buffer (allocating it if necessary).
+    //
+    static void recordSample( const SampleTimer& timer, const octetLock_t* objLock,
+                              octetLockState_t prevLock )
+    {
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          statClock::now() - timer.start_ ).count();
+
+        // Only we ever store to our context's profile_ (and it's never
+        //    freed), so there's no race here.
+        ProfileBuffer* buffer = myThreadInfo->profile_.load( std::memory_order_acquire );
+        if ( buffer == nullptr ) {
+            buffer = new ProfileBuffer();
+            myThreadInfo->profile_.store( buffer, std::memory_order_release );
+        }
+
+        uint64_t n = buffer->recorded_.load( std::memory_order_relaxed );
+        ProfileRecord& rec = buffer->records_[n % PROFILE_BUFFER_SIZE];
+
+        unsigned seq = rec.seq_.load( std::memory_order_relaxed );
+        rec.seq_.store( seq + 1, std::memory_order_relaxed );
+        std::atomic_thread_fence( std::memory_order_release );
+
+        rec.lock_.store( objLock, std::memory_order_relaxed );
+        rec.prevOwner_.store( IS_RDSH( prevLock )     ? nullptr :
+                              IS_RELEASED( prevLock ) ? GET_RELEASER( prevLock ) :
+                                                        GET_TID( prevLock ),
+                              std::memory_order_relaxed );
+        rec.waitNs_.store( ns, std::memory_order_relaxed );
+
+        rec.seq_.store( seq + 2, std::memory_order_release );
+        buffer->recorded_.store( n + 1, std::memory_order_release );
+    }
+
+    // noteTransition
+    //
+    //    Records that a slow path changed objLock from prevLock to
+    //    something of ours, in the lock's heat, and in the statistics
+    //    and/or the profile.
+    //
+    static inline void noteTransition( bool statistics, const SampleTimer& timer,
+                                       const octetLock_t* objLock,
+                                       octetLockState_t prevLock, Transition t )
+    {
+        switch ( t ) {
+            case WREX_TO_WREX:
+            case WREX_TO_RDEX:
+            case RDEX_TO_WREX:
+            case RDSH_TO_WREX:
+                // We had to ask someone.
+                adjustHeat( objLock, true );
+                break;
+            case RELEASED_TO_OWNED:
+                // (Taking an unowned lock is no conflict.)
+                adjustHeat( objLock, GET_RELEASER( prevLock ) != myThreadInfo &&
+                                     GET_RELEASER( prevLock ) != noThreadInfo() );
+                break;
+            default:
+                break;
+        }
+
+        if ( statistics ) {
+            bump( myThreadInfo->stats_.transitions[t] );
+        }
+        if ( timer.sampling_ ) {
+            recordSample( timer, objLock, prevLock );
+        }
+    }
+
+    // ownerSlot
+    //
+    //    How the profile reports identify owners.
+    //
+    static int ownerSlot( const OctetThreadInfo* owner )
+    {
+        if ( owner == nullptr ) return PROFILE_READERS;
+        if ( owner == noThreadInfo() ) return PROFILE_NO_OWNER;
+        return static_cast<int>( owner->slot_ );
+    }
+
+    std::vector<LockProfile> getProfile()
+    {
+        struct Totals {
+            uint64_t samples = 0;
+            uint64_t waitNs = 0;
+            std::map< std::pair<int,int>, uint64_t > pairs;
+        };
+        std::map< const void*, Totals > totals;
+
+        unsigned used = slotsUsed.load();
+        for (unsigned slot = 0; slot < used; ++slot) {
+            OctetThreadInfo* info = threadSlots[slot].info_.load();
+            if ( info == nullptr ) continue;
+
+            ProfileBuffer* buffer = info->profile_.load( std::memory_order_acquire );
+            if ( buffer == nullptr ) continue;
+
+            uint64_t recorded = buffer->recorded_.load( std::memory_order_acquire );
+            unsigned count = static_cast<unsigned>(
+                                 std::min<uint64_t>( recorded, PROFILE_BUFFER_SIZE ) );
+
+            for (unsigned i = 0; i < count; ++i) {
+                const ProfileRecord& rec = buffer->records_[i];
+
+                unsigned seq = rec.seq_.load( std::memory_order_acquire );
+                if ( seq & 1 ) continue;
+
+                const void* lock = rec.lock_.load( std::memory_order_relaxed );
+                const OctetThreadInfo* prev = rec.prevOwner_.load( std::memory_order_relaxed );
+                uint64_t waitNs = rec.waitNs_.load( std::memory_order_relaxed );
+
+                std::atomic_thread_fence( std::memory_order_acquire );
+                if ( rec.seq_.load( std::memory_order_relaxed ) != seq ) continue;
+
+                Totals& t = totals[lock];
+                ++t.samples;
+                t.waitNs += waitNs;
+                ++t.pairs[ std::make_pair( ownerSlot( prev ), static_cast<int>( slot ) ) ];
+            }
+        }
+
+        std::vector<LockProfile> profile;
+        for ( auto& entry : totals ) {
+            LockProfile lp;
+            lp.lock = entry.first;
+            lp.samples = entry.second.samples;
+            lp.waitNs = entry.second.waitNs;
+            for ( auto& pair : entry.second.pairs ) {
+                lp.pairs.push_back( OwnerPair{ pair.first.first, pair.first.second, pair.second } );
+            }
+            std::sort( lp.pairs.begin(), lp.pairs.end(),
+                       []( const OwnerPair& a, const OwnerPair& b ) { return a.samples > b.samples; } );
+            profile.push_back( lp );
+        }
+
+        // Hottest first.
+        std::sort( profile.begin(), profile.end(),
+                   []( const LockProfile& a, const LockProfile& b ) {
+                       return a.samples != b.samples ? a.samples > b.samples
+                                                     : a.waitNs > b.waitNs;
+                   } );
+
+        return profile;
+    }
+
+    // ownerName
+    //
+    //    For printProfile.
+    //
+    static const char* ownerName( int slot, char* buf, size_t size )
+    {
+        if ( slot == PROFILE_NO_OWNER ) return "free";
+        if ( slot == PROFILE_READERS )  return "readers";
+        snprintf( buf, size, "#%d", slot );
+        return buf;
+    }
+
+    void printProfile( unsigned maxLocks )
+    {
+        std::vector<LockProfile> profile = getProfile();
+
+        atomic_printf( "octet: hottest locks (of %u sampled; owners are context slots)\n",
+                       static_cast<unsigned>( profile.size() ) );
+
+        for (unsigned i = 0; i < profile.size() && i < maxLocks; ++i) {
+            const LockProfile& lp = profile[i];
+
+            char line[256];
+            int len = snprintf( line, sizeof(line), "octet: %p  %llu samples  %llu ns avg wait  ",
+                                lp.lock, (unsigned long long) lp.samples,
+                                (unsigned long long) ( lp.waitNs / lp.samples ) );
+
+            // The top few pairs of previous and new owners.
+            for (unsigned j = 0; j < lp.pairs.size() && j < 3; ++j) {
+                char from[16], to[16];
+                len += snprintf( line + len, sizeof(line) - len, " %s->%s x%llu",
+                                 ownerName( lp.pairs[j].from, from, sizeof(from) ),
+                                 ownerName( lp.pairs[j].to, to, sizeof(to) ),
+                                 (unsigned long long) lp.pairs[j].samples );
+            }
+
+            atomic_printf( "%s\n", line );
+        }
+
+        // And which owners fight the most, over all locks.
+        std::map< std::pair<int,int>, uint64_t > pairTotals;
+        for ( auto& lp : profile ) {
+            for ( auto& pair : lp.pairs ) {
+                pairTotals[ std::make_pair( pair.from, pair.to ) ] += pair.samples;
+            }
+        }
+
+        std::vector<OwnerPair> pairs;
+        for ( auto& entry : pairTotals ) {
+            pairs.push_back( OwnerPair{ entry.first.first, entry.first.second, entry.second } );
+        }
+        std::sort( pairs.begin(), pairs.end(),
+                   []( const OwnerPair& a, const OwnerPair& b ) { return a.samples > b.samples; } );
+
+        char line[256];
+        int len = snprintf( line, sizeof(line), "octet: busiest owner pairs:" );
+        for (unsigned j = 0; j < pairs.size() && j < 5; ++j) {
+            char from[16], to[16];
+            len += snprintf( line + len, sizeof(line) - len, " %s->%s x%llu",
+                             ownerName( pairs[j].from, from, sizeof(from) ),
+                             ownerName( pairs[j].to, to, sizeof(to) ),
+                             (unsigned long long) pairs[j].samples );
+        }
+        atomic_printf( "%s\n", line );
+    }
+
+    ////////////////////////////////////////////
+    // Implementation Code for (slow) read and write barriers
+    ////////////////////////////////////////////
+
+    // takeReleased
+    //
+    //    If the lock has been released (or is unowned), tries to take it
+    //    (in newState) with a single compare_exchange; no one needs to be
+    //    asked. Returns whether that worked. (Statistics says whether to
+    //    count it; requests, which have no Policy, say so themselves.)
+    //
+    template <typename Policy, bool Statistics = Policy::statistics>
+    static inline bool takeReleased( octetLock_t* objLock, octetLockState_t newState )
+    {
+        // Memory order: the acquire synchronizes with the release in
+        //    releaseSlowPath, so we see everything the last owner did.
+        octetLockState_t curLock = loadLock( objLock, Policy::order( std::memory_order_relaxed ) );
+
+        if ( IS_RELEASED( curLock ) &&
+             compareExchangeLockStrong( objLock, curLock, newState,
+                                        Policy::order( std::memory_order_acquire ),
+                                        Policy::order( std::memory_order_relaxed ) ) ) {
+
+            PTRACE(Policy, "Thread 0x%x took released lock 0x%x\n", myThreadInfo, objLock);
+
+            noteTransition( Statistics, SampleTimer(), objLock, curLock, RELEASED_TO_OWNED );
+            return true;
+        }
+
+        return false;
+    }
+
+    // releaseSlowPath
+    //
+    //    Releases a pessimistic lock, if it's still entirely ours.
+    //    (If it's RdSh, or someone has already made it INTERMEDIATE, we
+    //    just keep it until we're asked for it, as usual.)
+    //
+    void releaseSlowPath( octetLock_t* objLock )
+    {
+        octetLockState_t curLock = loadLock( objLock MEM_ORD(, std::memory_order_relaxed) );
+
+        if ( curLock == WREX( myThreadInfo ) || curLock == RDEX( myThreadInfo ) ) {
+
+            TRACE("Thread 0x%x releasing 0x%x\n", myThreadInfo, objLock);
+
+            // Memory order: whoever takes the lock next must see our
+            //    changes to the data (see takeReleased).
+            compareExchangeLockStrong( objLock, curLock, RELEASED( myThreadInfo )
+                                       MEM_ORD(, std::memory_order_release,
+                                                 std::memory_order_relaxed) );
+        }
+    }
+
+    // cpuRelax
+    //
+    //    Tells the CPU we're in a spin loop.
+    //
+    static inline void cpuRelax()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+        asm volatile("yield");
+#endif
+    }
+
+    // How many times we yield (waiting for a response, or for an
+    //    INTERMEDIATE lock) before going to sleep.
+    const int YIELDS_BEFORE_PARKING = 32;
+
+#if PARKING
+
+    // parkWhileIntermediate
+    //
+    //    Sleeps until the lock is no longer INTERMEDIATE. As in
+    //    parkUntilResponse (below), we're blocked while we sleep.
+    //
+    static void parkWhileIntermediate( octetLock_t* objLock )
     {
-        requests_.fetch_and( ~1 MEM_ORD(, std::memory_order_acq_rel) );
-    }
+        TRACE("Thread 0x%x parking on 0x%x\n", myThreadInfo, objLock);
 
+        myThreadInfo->handleRequests( true );
 
+        octetLockState_t curLock = loadLock( objLock MEM_ORD(, std::memory_order_relaxed) );
 
+        while ( IS_INTERMEDIATE( curLock ) ) {
 
-    ////////////////////////////////////////////
-    // Implementation Code for (slow) read and write barriers
-    ////////////////////////////////////////////
+            // Mark the lock so that whoever finishes acquiring it knows to
+            //    wake us up.
+            if ( curLock == INTERMEDIATE_PARKED ||
+                 compareExchangeLockWeak( objLock, curLock, INTERMEDIATE_PARKED ) ) {
+
+                futexWait( futexWord( objLock ),
+                           static_cast<uint32_t>( INTERMEDIATE_PARKED ) );
+
+                curLock = loadLock( objLock MEM_ORD(, std::memory_order_relaxed) );
+            }
+        }
+
+        myThreadInfo->unblock();
+    }
+
+#endif // PARKING
 
-    int INTERMEDIATE_BACKOFF_RETRIES = 1;
-    int INTERMEDIATE_BACKOFF_EXPLIMIT = 1;
+    // Each thread keeps an estimate of how many spins it takes for an
+    //    INTERMEDIATE lock to be resolved. If we usually succeed by spinning,
+    //    the estimate converges to the typical wait; if spinning usually
+    //    fails, it shrinks, and we move on to yielding (and parking) sooner.
+    const unsigned MIN_INTERMEDIATE_SPINS = 16;
+    const unsigned MAX_INTERMEDIATE_SPINS = 4096;
+
+    __thread unsigned intermediateSpinEstimate = MIN_INTERMEDIATE_SPINS;
+
+    // Spinning can't help if no other thread can run while we spin.
+    static const bool multiprocessor = std::thread::hardware_concurrency() != 1;
 
     // lockIntermediate
     //
@@ -179,7 +1090,9 @@ namespace octet {
     //
     //    If the lock is already in an intermediate state when this
     //       code is called, we wait until it's not (and *then*
-    //       mark it as intermediate).
+    //       mark it as intermediate). If SPIN_ON_INTERMEDIATE is set, we
+    //       spin briefly (for about as long as INTERMEDIATE states have
+    //       recently lasted); then we yield, then (if PARKING is set) sleep.
     octetLockState_t lockIntermediate( octetLock_t* objLock )
     {
 
@@ -188,43 +1101,195 @@ namespace octet {
         // Memory order: since anything we read will be verified by compare_exchange,
         //               stale data would not be problematic.
         octetLockState_t prevLock =
-           objLock->load( MEM_ORD( std::memory_order_relaxed ) );
+           loadLock( objLock MEM_ORD(, std::memory_order_relaxed) );
 
-        while (prevLock == INTERMEDIATE ||
-               ! objLock->compare_exchange_weak( prevLock, INTERMEDIATE ) ) {
+        unsigned spinLimit = ! (SPIN_ON_INTERMEDIATE && multiprocessor) ? 0 :
+            std::min( 2 * intermediateSpinEstimate, MAX_INTERMEDIATE_SPINS );
+        unsigned waits = 0;
 
-            // In practice, adding this yield produces a huge performance boost
-            //    when the test has more threads than cpus
-            //    (e.g., on my 4-core Macbook Pro,
-            //        6 threads, 10000 iterations, 1000 accounts)
-            // I tried adding an exponential backoff as in lock(), and at least
-            // for high contention (10/10000/10 stresstest), it was 5-6x slower.
-            std::this_thread::yield();
+        for (;;) {
 
+            if ( ! IS_INTERMEDIATE( prevLock ) ) {
 
-            // We can't grab the lock yet, so to avoid deadlock, we
-            // respond to any pending requests.
-            myThreadInfo->handleRequests( false );
+                if ( compareExchangeLockWeak( objLock, prevLock, INTERMEDIATE ) ) {
+                    break;
+                }
+
+                // Someone else changed the lock (and compare_exchange updated
+                //    prevLock); unless it became INTERMEDIATE, just try again.
+                continue;
+            }
+
+            // Someone else is in the middle of acquiring the lock.
+            ++waits;
+
+            if ( waits <= spinLimit ) {
+
+                cpuRelax();
+
+                // To avoid deadlock, we respond to any pending requests.
+                //    (The thread holding the lock INTERMEDIATE may be
+                //    waiting for us.)
+                poll();
+
+            } else if ( waits <= spinLimit + YIELDS_BEFORE_PARKING || ! PARKING ) {
 
-            // If the compare_exchange failed, then prevLock has already
-            //   changed (been updated). But the value might have changed
-            //   again while we were handling requests, so it doesn't hurt
-            //   to re-update it. Plus, if the lock was in an intermediate
-            //   state, we didn't attempt the compare_exchange and must
-            //   poll again to see if the intermediate lock has resolved
+                // In practice, yielding produces a huge performance boost
+                //    when the test has more threads than cpus
+                //    (e.g., on my 4-core Macbook Pro,
+                //        6 threads, 10000 iterations, 1000 accounts)
+                std::this_thread::yield();
+
+                myThreadInfo->handleRequests( false );
+
+            } else {
+#if PARKING
+                parkWhileIntermediate( objLock );
+#endif
+            }
+
+            // Poll again to see if the intermediate lock has resolved
             //   to a new owner.
             //
             // Memory order: see above.
-            prevLock = objLock->load( MEM_ORD( std::memory_order_relaxed ) );
+            prevLock = loadLock( objLock MEM_ORD(, std::memory_order_relaxed) );
+        }
+
+        // Update our estimate (a moving average, as in glibc's adaptive mutexes).
+        if ( waits > 0 ) {
+            if ( waits <= spinLimit ) {
+                intermediateSpinEstimate +=
+                    (static_cast<int>(waits) - static_cast<int>(intermediateSpinEstimate)) / 8;
+            } else {
+                intermediateSpinEstimate -= intermediateSpinEstimate / 4;
+            }
+            intermediateSpinEstimate =
+                std::max( intermediateSpinEstimate, MIN_INTERMEDIATE_SPINS );
         }
 
         TRACE("Thread 0x%x set 0x%x to intermediate\n", myThreadInfo, objLock);
 
-        assert ( prevLock != INTERMEDIATE );
+        assert ( ! IS_INTERMEDIATE( prevLock ) );
 
         return prevLock;
     }
 
+    // unlockIntermediate
+    //
+    //    Replace the INTERMEDIATE state we set with the final state of
+    //    the lock, waking up anyone who went to sleep waiting for it.
+    //
+    static inline void unlockIntermediate( octetLock_t* objLock, octetLockState_t newState,
+                                           std::memory_order order = std::memory_order_seq_cst )
+    {
+        (void) order;  // (Unused if SEQUENTIAL.)
+#if PARKING
+        if ( exchangeLock( objLock, newState MEM_ORD(, order) ) == INTERMEDIATE_PARKED ) {
+            futexWake( futexWord( objLock ) );
+        }
+#else
+        storeLock( objLock, newState MEM_ORD(, order) );
+#endif
+    }
+
+    ////////////////////////////////////////////
+    // Response signals
+    ////////////////////////////////////////////
+
+    // The signal (or 0) and delay chosen by setResponseSignal.
+    static std::atomic<int> responseSignal(0);
+    static std::atomic<unsigned> responseSignalUs(0);
+
+    // respondToSignal
+    //
+    // The handler for response signals. The thread might have been
+    //    interrupted anywhere, so it can only respond if it's in an
+    //    AsyncSafeScope (and so isn't using its locks, or handling
+    //    requests itself). handleRequests is fine in a signal handler:
+    //    it's just lock-free atomics (and perhaps a futex wake).
+    //
+    static void respondToSignal( int )
+    {
+        if ( asyncSafe && myThreadInfo != nullptr ) {
+            int savedErrno = errno;
+            myThreadInfo->handleRequests( false );
+            errno = savedErrno;
+        }
+    }
+
+    bool setResponseSignal( int signo, unsigned afterUs )
+    {
+#ifdef __linux__
+        if ( signo != 0 ) {
+            struct sigaction action;
+            action.sa_handler = respondToSignal;
+            sigemptyset( &action.sa_mask );
+            action.sa_flags = SA_RESTART;
+            if ( sigaction( signo, &action, nullptr ) != 0 ) return false;
+        }
+
+        responseSignalUs.store( afterUs, std::memory_order_relaxed );
+        responseSignal.store( signo, std::memory_order_release );
+        return true;
+#else
+        return signo == 0;
+#endif
+    }
+
+    // Nudger
+    //
+    // Sends response signals (if they're turned on) to an owner we've
+    //    been waiting for too long. Costs one load if they're off.
+    //
+    class Nudger {
+        int signo_;
+        std::chrono::steady_clock::duration delay_;
+        std::chrono::steady_clock::time_point next_;
+
+    public:
+        Nudger() : signo_( responseSignal.load( std::memory_order_acquire ) ), delay_( 0 )
+        {
+            if ( signo_ ) {
+                delay_ = std::chrono::microseconds(
+                             responseSignalUs.load( std::memory_order_relaxed ) );
+                next_  = std::chrono::steady_clock::now() + delay_;
+            }
+        }
+
+        // Signals the owner if we've waited long enough since the start
+        //    (or since the last signal).
+        void check( OctetThreadInfo* owner )
+        {
+            if ( ! signo_ ) return;
+
+            auto now = std::chrono::steady_clock::now();
+            if ( now < next_ ) return;
+            next_ = now + delay_;
+
+#ifdef __linux__
+            // (If the owner has just detached, the signal goes to a thread
+            //    that's not in an AsyncSafeScope for it, which ignores it.)
+            int tid = owner->tid_.load( std::memory_order_relaxed );
+            if ( tid != 0 ) {
+                syscall( SYS_tgkill, getpid(), tid, signo_ );
+            }
+#endif
+        }
+
+#if PARKING
+        // How long we can sleep before the next check (nullptr: forever).
+        const struct timespec* sleepLimit( struct timespec& limit ) const
+        {
+            if ( ! signo_ ) return nullptr;
+
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>( delay_ ).count();
+            limit.tv_sec  = ns / 1000000000;
+            limit.tv_nsec = ns % 1000000000;
+            return &limit;
+        }
+#endif
+    };
+
     // ping
     //
     // Notifies another thread that we want something they have locked.
@@ -234,7 +1299,7 @@ namespace octet {
     //     at the time of the ping. [If so, we can just go ahead with
     //     the acquire, rather than waiting for a response.]
     //
-    uint32_t ping( OctetThreadInfo* owner, bool& owner_was_blocked )
+    octetCount_t ping( OctetThreadInfo* owner, bool& owner_was_blocked )
     {
         assert ( owner != nullptr );
         assert ( owner != myThreadInfo );
@@ -247,13 +1312,11 @@ namespace octet {
         // Increase by 2 because the LSB bit is being used as a flag.
         // Note: fetch_add returns the *previous* value of the variable,
         //       but += returns the *updated* value.
-        uint32_t req = owner->requests_ += 2;
+        //       (The count may wrap around; that's fine.)
+        octetCount_t req = owner->requests_ += 2;
 
-        // If this assert fails, we need to switch from 31-bit to 63-bit counters
-        assert (req < 2147483644ul);  // 2^31 - 4
-
-        owner_was_blocked          = req & 1;
-        uint32_t new_request_count = req >> 1;
+        owner_was_blocked              = req & 1;
+        octetCount_t new_request_count = countOf( req );
 
         TRACE(owner_was_blocked ? "Thread 0x%x pinged 0x%x (blocked)\n":
               "Thread 0x%x pinged 0x%x\n", myThreadInfo, owner);
@@ -261,36 +1324,109 @@ namespace octet {
         return new_request_count;
     }
 
+#if PARKING
+
+    // parkUntilResponse
+    //
+    // Sleeps until the specified thread's response count reaches the
+    //   desired value.
+    //
+    // We can't respond to requests while we're asleep, so we block
+    //   ourselves first (implicitly granting anything anyone asks for
+    //   in the mean time), and unblock once we're awake again.
+    //
+    static void parkUntilResponse( OctetThreadInfo* owner, octetCount_t desired_response_count,
+                                   Nudger& nudger )
+    {
+        TRACE("Thread 0x%x parking until 0x%x responds\n", myThreadInfo, owner);
+
+        myThreadInfo->handleRequests( true );
+
+        // Memory order: see awaitResponse.
+        octetCount_t response = owner->responses_.load( MEM_ORD( std::memory_order_acquire ) );
+
+        while ( ! countReached( countOf( response ), desired_response_count ) ) {
+
+            // Set the "parked" bit so that the owner knows to wake us.
+            //    If the response changes first, the compare_exchange fails
+            //    (updating response) and we check again.
+            if ( (response & 0x1) ||
+                 owner->responses_.compare_exchange_weak( response, response | 0x1
+                                                          MEM_ORD(, std::memory_order_acquire) ) ) {
+
+                // Sleeps unless the response has changed since we set the bit
+                //    (or until it's time for another response signal).
+                struct timespec limit;
+                futexWait( futexWord( &owner->responses_ ),
+                           static_cast<uint32_t>( response | 0x1 ),
+                           nudger.sleepLimit( limit ) );
+                nudger.check( owner );
+
+                response = owner->responses_.load( MEM_ORD( std::memory_order_acquire ) );
+            }
+        }
+
+        myThreadInfo->unblock();
+    }
+
+#endif // PARKING
+
     // awaitResponse
     //
     // Waits until the specified thread approves our request (by
     //   incrementing its response count sufficiently).
     //
     //
-    void awaitResponse( OctetThreadInfo* owner, uint32_t desired_response_count )
+    void awaitResponse( OctetThreadInfo* owner, octetCount_t desired_response_count )
     {
         assert ( owner != nullptr );
 
         // Memory order: if we do get a response, we want to make sure that we will
         //               be able to see all data written by the owner before they
         //               responded.
-        uint32_t response_count = owner->responses_.load( MEM_ORD( std::memory_order_acquire ) );
+        octetCount_t response_count =
+            countOf( owner->responses_.load( MEM_ORD( std::memory_order_acquire ) ) );
 
         TRACE("Thread 0x%x waiting for response from 0x%x\n", myThreadInfo, owner);
 
-        while( response_count < desired_response_count ) {
+#if PARKING
+        int yields = 0;
+#endif
+        Nudger nudger;
+
+        while( ! countReached( response_count, desired_response_count ) ) {
+
+            // A detached context is always at a safe point, so we can
+            //    respond on its behalf instead of waiting for it to be
+            //    attached again.
+            if ( ! owner->attached_.load( MEM_ORD( std::memory_order_relaxed ) ) &&
+                 respondFor( owner ) ) {
+                response_count =
+                    countOf( owner->responses_.load( MEM_ORD( std::memory_order_acquire ) ) );
+                continue;
+            }
+
+#if PARKING
+            // If it's taking a while, stop competing with the owner for CPU time.
+            if ( ++yields > YIELDS_BEFORE_PARKING ) {
+                parkUntilResponse( owner, desired_response_count, nudger );
+                return;
+            }
+#endif
 
             // If not, yield, and try again.
             //    (This function is a little bit convoluted, because we don't want
             //    to yield if the response was immediate.)
-            // TODO: would it be better to sleep (with increasing backoff?)
             std::this_thread::yield();
 
+            nudger.check( owner );
+
             // Need to handle requests while waiting, to avoid deadlock.
             myThreadInfo->handleRequests( false );
 
             // Mmeory order: see above.
-            response_count = owner->responses_.load( MEM_ORD( std::memory_order_acquire ) );
+            response_count =
+                countOf( owner->responses_.load( MEM_ORD( std::memory_order_acquire ) ) );
         }
     }
 
@@ -307,7 +1443,7 @@ namespace octet {
 
         // Ping the owner
         bool ownerWasBlocked = false;
-        uint32_t desired_response_count = ping( owner, ownerWasBlocked );
+        octetCount_t desired_response_count = ping( owner, ownerWasBlocked );
 
         // Wait until the owner is blocked or has responded.
         //   (The owner will respond before blocking, so we
@@ -318,6 +1454,88 @@ namespace octet {
         }
     }
 
+    // PingSet
+    //
+    //    Pings a number of threads, each at most once, and then waits for
+    //    all of them to respond (so that the round trips overlap).
+    //
+    //    To avoid allocating, it remembers at most PING_BATCH threads, and
+    //    waits for a full batch to respond before pinging any more.
+    //    (Pinging twice is harmless, just slower.)
+    //
+    class PingSet {
+        static const unsigned PING_BATCH = 64;
+
+        OctetThreadInfo* peers_[PING_BATCH];
+        octetCount_t counts_[PING_BATCH];
+        bool wasBlocked_[PING_BATCH];
+        unsigned size_;
+
+    public:
+        PingSet() : size_(0) {}
+
+        void add( OctetThreadInfo* peer )
+        {
+            assert( peer != nullptr );
+
+            if ( peer == myThreadInfo ) return;
+
+            for (unsigned i = 0; i < size_; ++i) {
+                if ( peers_[i] == peer ) return;
+            }
+
+            if ( size_ == PING_BATCH ) awaitAll();
+
+            bool wasBlocked = false;
+            counts_[size_] = ping( peer, wasBlocked );
+            wasBlocked_[size_] = wasBlocked;
+            peers_[size_] = peer;
+            ++size_;
+        }
+
+        // Waits for everyone pinged so far (who wasn't blocked at the time).
+        void awaitAll()
+        {
+            for (unsigned i = 0; i < size_; ++i) {
+                if ( ! wasBlocked_[i] ) {
+                    awaitResponse( peers_[i], counts_[i] );
+                }
+            }
+            size_ = 0;
+        }
+    };
+
+    // pingReaders
+    //
+    //    Pings every registered thread whose bit is in the reader set.
+    //    (A bit may be shared by several threads, and we can't tell
+    //    which one actually did the reading, so we ask all of them.)
+    //
+    //    Threads may register or unregister while we're scanning, so
+    //    we ping the OctetThreadInfo in every matching slot, in use
+    //    or not. A thread that unregisters blocks first (responding
+    //    to any requests), so we'll either see it as blocked or get
+    //    a response. A thread that takes over a slot unblocks with
+    //    an atomic read-modify-write on the same word we ping; if our
+    //    ping came first, it will see the lock as INTERMEDIATE, and
+    //    otherwise we'll wait for its response.
+    //
+    static void pingReaders( PingSet& pings, octetLockState_t readers )
+    {
+        unsigned used = slotsUsed.load();
+
+        for (unsigned slot = 0; slot < used; ++slot) {
+
+            if ( ! (READER_BIT(slot) & readers) ) continue;
+
+            OctetThreadInfo* peer = threadSlots[slot].info_.load();
+
+            if ( peer != nullptr ) {
+                pings.add( peer );
+            }
+        }
+    }
+
     // writeSlowPath
     //
     //   Locks the given lock for write-exclusive access
@@ -325,12 +1543,17 @@ namespace octet {
     //   Returns a flag stating whether we've lost any previous locks
     //       (agreed to other threads' requests) in the process
     //
+    template <typename Policy>
     bool writeSlowPath( octetLock_t* objLock )
     {
+        if ( Policy::statistics ) {
+            bump( myThreadInfo->stats_.slowWrites );
+        }
 
-#if STATISTICS
-        ++slowWrites;
-#endif
+        if ( takeReleased<Policy>( objLock, MY_WREX ) ) {
+            // We didn't have to wait, so we can't have lost any locks.
+            return false;
+        }
 
         // We count the number of responses before and after the slow path,
         //    to detect whether we granted any requests (lost any locks) in
@@ -341,79 +1564,79 @@ namespace octet {
         //    the response count, we don't have to worry about preserving
         //    inter-thread dependencies here when peeking at the count.
 
-        uint32_t requestsBefore =
-        myThreadInfo->responses_.load( MEM_ORD( std::memory_order_relaxed ) );
-
-        // XXX: If the thread is unlocked, it would make more sense to
-        // grab it directly, rather than setting it to INTERMEDIATE
-        // and notifying a non-existent "owner"
+        octetCount_t requestsBefore =
+        countOf( myThreadInfo->responses_.load( MEM_ORD( std::memory_order_relaxed ) ) );
 
-        octetLockState_t prevLock = lockIntermediate( objLock );
+        // (Unowned locks were taken by takeReleased above. A blocked
+        // owner still gets the INTERMEDIATE state and a ping, though:
+        // it could unblock at any moment and pass its fast path on the
+        // lock, and it has to find out that it lost something. The same
+        // goes for a thread that has shut down, since its OctetThreadInfo
+        // will be reused.)
 
-#if READSHARED
-        if ( IS_RDSH( prevLock ) ) {
+        SampleTimer sampleTimer;
+        statClock::time_point waitStart = startTimer<Policy::statistics>();
 
-            // XXX  We can lock the activeThreads set while we're notifying everyone, but
-            // What happens if threads appear or disappear while we're waiting !!??
+        octetLockState_t prevLock = lockIntermediate( objLock );
 
-            // Ping *everyone* (sigh...)
+        recordWait<Policy::statistics>( myThreadInfo->stats_.intermediateNs, waitStart );
+        waitStart = startTimer<Policy::statistics>();
 
-            TRACE("Thread 0x%x wants to write to RdSh data 0x%x; notifying everyone\n", myThreadInfo, objLock)
+        Transition transition;
 
-            activeThreadsMutex.lock();
+        if ( IS_RELEASED( prevLock ) ) {
 
-            std::vector<std::pair<OctetThreadInfo*,uint32_t>> peers;
+            // It was released while we were on our way here.
+            transition = RELEASED_TO_OWNED;
 
-            for (OctetThreadInfo* owner : activeThreads ) {
+        // (Only read-shared locks can be RdSh.)
+        } else if ( Policy::readShared && IS_RDSH( prevLock ) ) {
 
-                if ( owner != myThreadInfo ) {
-                    bool wasBlocked = false;
-                    uint32_t count = ping( owner, wasBlocked );
-                    if (! wasBlocked  ) {
-                        peers.push_back( std::make_pair(owner,count) );
-                    }
-                }
-            }
+            transition = RDSH_TO_WREX;
 
-            activeThreadsMutex.unlock();
+            // Ask all the readers (at once).
+            octetLockState_t readers = GET_READERS( prevLock );
 
-            // Wait for each in turn to respond.
+            PTRACE(Policy, "Thread 0x%x wants to write to RdSh data 0x%x; notifying readers 0x%x\n",
+                   myThreadInfo, objLock, readers);
 
-            for (auto& peer : peers)
-            {
-                assert( peer.first != nullptr );
+            PingSet pings;
+            pingReaders( pings, readers );
+            pings.awaitAll();
 
-                awaitResponse( peer.first, peer.second );
-            }
+            recordWait<Policy::statistics>( myThreadInfo->stats_.awaitNs, waitStart );
 
         } else {
-#endif // READSHARED
             OctetThreadInfo* owner = GET_TID( prevLock );
 
             if ( owner != myThreadInfo) {
                 // Another thread holds a RdEx or WrEx lock
+                transition = IS_RDEX( prevLock ) ? RDEX_TO_WREX : WREX_TO_WREX;
                 notifyOne( owner );
+                recordWait<Policy::statistics>( myThreadInfo->stats_.awaitNs, waitStart );
             } else {
                 // Only other possibility (since we're on the slow path):
                 //  upgrading our own read-lock to a write-lock.
-                assert ( prevLock = RDEX(myThreadInfo) );
+                assert ( prevLock == MY_RDEX );
+                transition = UPGRADE;
             }
-#if READSHARED
         }
-#endif
         // OK, mark it as ours!
 
 
         // Memory order: This is after we used CAS to set the same variable to INTERMEDIATE;
         //               whether other threads see that or this, they're still not allowed
         //               to observe the protected data.
-        objLock->store( WREX(myThreadInfo) MEM_ORD(, std::memory_order_relaxed ) );
+        unlockIntermediate( objLock, MY_WREX,
+                            Policy::order( std::memory_order_relaxed ) );
+
+        PTRACE(Policy, "Thread 0x%x can now write to 0x%x\n", myThreadInfo, objLock);
 
-        TRACE("Thread 0x%x can now write to 0x%x\n", myThreadInfo, objLock)
+        noteTransition( Policy::statistics, sampleTimer, objLock, prevLock, transition );
 
         // Memory order: see above.
-        uint32_t requestsAfter =
-        myThreadInfo->responses_.load( MEM_ORD( std::memory_order_relaxed ) );
+        octetCount_t requestsAfter =
+        countOf( myThreadInfo->responses_.load( MEM_ORD( std::memory_order_relaxed ) ) );
 
         // Did we grant any requests while waiting?
         bool requestsWereGranted = requestsBefore != requestsAfter;
@@ -421,8 +1644,6 @@ namespace octet {
         return requestsWereGranted;
     }
 
-#if READSHARED
-
     // readSlowPath
     //
     //   Locks the given lock for read-exclusive or read-shared access
@@ -432,12 +1653,18 @@ namespace octet {
     //   Returns a flag stating whether we've lost any previous locks
     //       (agreed to other threads' requests) in the process
     //
+    //   (Only used for read-shared locks; see readBarrier.)
+    //
+    template <typename Policy>
     bool readSlowPath( octetLock_t* objLock )
     {
+        if ( Policy::statistics ) {
+            bump( myThreadInfo->stats_.slowReads );
+        }
 
-#if STATISTICS
-        slowReads++;
-#endif
+        if ( takeReleased<Policy>( objLock, MY_RDEX ) ) {
+            return false;
+        }
 
         // We count the number of responses before and after the slow path,
         //    to detect whether we granted any requests (lost any locks) in
@@ -448,34 +1675,70 @@ namespace octet {
         //    the response count, we don't have to worry about preserving
         //    inter-thread dependencies here when peeking at the count.
 
-        uint32_t requestsBefore =
-        myThreadInfo->responses_.load( MEM_ORD( std::memory_order_relaxed ) );
+        octetCount_t requestsBefore =
+        countOf( myThreadInfo->responses_.load( MEM_ORD( std::memory_order_relaxed ) ) );
+
+        octetLockState_t myBit = myThreadInfo->readerBit_;
+
+        // If the lock is already read-shared, we can just add ourselves
+        //    to the reader set; readers don't need each other's permission.
+        //
+        // Memory order: the compare_exchange (seq_cst) makes sure we see
+        //    everything that happened-before the lock became RdSh.
+        SampleTimer sampleTimer;
+
+        octetLockState_t curLock = loadLock( objLock, Policy::order( std::memory_order_relaxed ) );
+
+        while ( IS_RDSH( curLock ) ) {
+            if ( compareExchangeLockWeak( objLock, curLock, curLock | myBit ) ) {
+                PTRACE(Policy, "Thread 0x%x joined readers of 0x%x\n", myThreadInfo, objLock);
+                noteTransition( Policy::statistics, sampleTimer, objLock, curLock, RDSH_TO_RDSH );
+                return false;
+            }
+        }
+
+        statClock::time_point waitStart = startTimer<Policy::statistics>();
 
         octetLockState_t prevLock = lockIntermediate( objLock );
 
-        assert( prevLock != INTERMEDIATE );
+        recordWait<Policy::statistics>( myThreadInfo->stats_.intermediateNs, waitStart );
+
+        assert( ! IS_INTERMEDIATE( prevLock ) );
+
+        Transition transition;
 
-        if ( IS_RDSH( prevLock ) ) {
+        if ( IS_RELEASED( prevLock ) ) {
 
-            // Normally we wouldn't take the slow path if the lock was already
+            // It was released while we were on our way here.
+            transition = RELEASED_TO_OWNED;
+
+            unlockIntermediate( objLock, RDEX( myThreadInfo ) );
+
+        } else if ( IS_RDSH( prevLock ) ) {
+
+            // Normally we wouldn't get this far if the lock was already
             // read-shared, but it's possible that the state was changed by
             // another thread to RdSh while we were waiting for our turn to
             // set the lock to INTERMEDIATE. (E.g., we're in the slow path
             // because another thread had it RdEx, and a third thread snuck
             // in and set it to RdSh before we got our hands on the lock.)
 
-            // We've already set it to INTERMEDIATE; put it back the way it was.
+            // We've already set it to INTERMEDIATE; put it back the way it was,
+            // plus ourselves.
 
-            objLock->store( RDSH );
+            transition = RDSH_TO_RDSH;
+            unlockIntermediate( objLock, prevLock | myBit );
 
         } else if ( IS_RDEX( prevLock ) ) {
 
             // Someone else had it locked for exclusive reading.
-            // Generalize the lock to RdSh
+            // Generalize the lock to RdSh, with both of us as readers.
 
-            assert( GET_TID ( prevLock) != myThreadInfo );
+            OctetThreadInfo* owner = GET_TID( prevLock );
+            assert( owner != myThreadInfo );
 
-            objLock->store( RDSH );
+            transition = RDEX_TO_RDSH;
+            unlockIntermediate( objLock, RDSH( owner->readerBit_ | myBit ) );
 
         } else {
 
@@ -485,23 +1748,301 @@ namespace octet {
             OctetThreadInfo* owner = GET_TID( prevLock );
             assert( owner != nullptr );
 
+            transition = WREX_TO_RDEX;
+
+            waitStart = startTimer<Policy::statistics>();
             notifyOne( owner );
+            recordWait<Policy::statistics>( myThreadInfo->stats_.awaitNs, waitStart );
 
-            objLock->store( RDEX( myThreadInfo ) );
+            unlockIntermediate( objLock, RDEX( myThreadInfo ) );
         }
 
-        TRACE("Thread 0x%x can now read 0x%x\n", myThreadInfo, objLock)
+        PTRACE(Policy, "Thread 0x%x can now read 0x%x\n", myThreadInfo, objLock);
+
+        noteTransition( Policy::statistics, sampleTimer, objLock, prevLock, transition );
 
         // See above for the justification of "relaxed"
-        uint32_t requestsAfter =
-        myThreadInfo->responses_.load( MEM_ORD( std::memory_order_relaxed ) );
+        octetCount_t requestsAfter =
+        countOf( myThreadInfo->responses_.load( MEM_ORD( std::memory_order_relaxed ) ) );
 
         // Did we grant any requests while waiting?
         bool requestsWereGranted = requestsBefore != requestsAfter;
 
         return requestsWereGranted;
     }
-#endif // READSHARED
+
+    // The library provides the slow paths for every LockPolicy.
+    //    (readSlowPath is only needed for read-shared ones.)
+
+#define INSTANTIATE_SLOW_PATHS(STATS, SEQ, DBG)                                       \
+    template bool writeSlowPath< LockPolicy<false, STATS, SEQ, DBG> >( octetLock_t* ); \
+    template bool writeSlowPath< LockPolicy<true,  STATS, SEQ, DBG> >( octetLock_t* ); \
+    template bool readSlowPath < LockPolicy<true,  STATS, SEQ, DBG> >( octetLock_t* );
+
+    INSTANTIATE_SLOW_PATHS(false, false, false)
+    INSTANTIATE_SLOW_PATHS(false, false, true )
+    INSTANTIATE_SLOW_PATHS(false, true,  false)
+    INSTANTIATE_SLOW_PATHS(false, true,  true )
+    INSTANTIATE_SLOW_PATHS(true,  false, false)
+    INSTANTIATE_SLOW_PATHS(true,  false, true )
+    INSTANTIATE_SLOW_PATHS(true,  true,  false)
+    INSTANTIATE_SLOW_PATHS(true,  true,  true )
+
+#undef INSTANTIATE_SLOW_PATHS
+
+    ////////////////////////////////////////////
+    // Acquiring several locks at once
+    ////////////////////////////////////////////
+
+    // acquireGroup
+    //
+    //   Acquires the given locks (skipping requests whose prevState
+    //       is NOTHING_TO_DO), with one round trip per owner.
+    //
+    //   We can't ping an owner until all of its locks are INTERMEDIATE,
+    //       since otherwise it could respond and then carry on using a
+    //       lock that we haven't gotten to yet. So we make every lock
+    //       INTERMEDIATE first, then ping each owner once (covering all
+    //       its locks), and then wait for all the responses.
+    //
+    //   Holding several INTERMEDIATE locks at once could deadlock with
+    //       another thread doing the same thing, so the requests must be
+    //       sorted by address. (The ordinary slow paths only hold one at
+    //       a time.)
+    //
+    //   prevState doubles as a flag for which requests need work:
+    //       NOTHING_TO_DO (which lockIntermediate never returns) means none.
+    //
+    static const octetLockState_t NOTHING_TO_DO = INTERMEDIATE;
+
+    template <bool Statistics>
+    static void acquireGroup( LockRequest* requests, size_t n )
+    {
+        SampleTimer sampleTimer;
+        statClock::time_point waitStart = startTimer<Statistics>();
+
+        // Step 1: make them all INTERMEDIATE.
+        for (size_t i = 0; i < n; ++i) {
+            LockRequest& request = requests[i];
+            if ( request.prevState == NOTHING_TO_DO ) continue;
+
+            request.prevState = lockIntermediate( request.lock );
+        }
+
+        recordWait<Statistics>( myThreadInfo->stats_.intermediateNs, waitStart );
+        waitStart = startTimer<Statistics>();
+
+        // Step 2: ask everyone who has to give something up.
+        PingSet pings;
+
+        for (size_t i = 0; i < n; ++i) {
+            const LockRequest& request = requests[i];
+            octetLockState_t prevLock = request.prevState;
+            if ( prevLock == NOTHING_TO_DO || IS_RELEASED( prevLock ) ) continue;
+
+            if ( IS_RDSH( prevLock ) ) {
+                // (Readers can join without asking.)
+                if ( request.write ) {
+                    pingReaders( pings, GET_READERS( prevLock ) );
+                }
+            } else if ( request.write || IS_WREX( prevLock ) ) {
+                // (Unless we're upgrading our own RdEx lock, or joining
+                //  another thread's, someone has to give it up.)
+                pings.add( GET_TID( prevLock ) );
+            }
+        }
+
+        // Step 3: wait for all of them.
+        pings.awaitAll();
+
+        recordWait<Statistics>( myThreadInfo->stats_.awaitNs, waitStart );
+
+        // Step 4: mark the locks as ours.
+        octetLockState_t myBit = myThreadInfo->readerBit_;
+
+        for (size_t i = 0; i < n; ++i) {
+            const LockRequest& request = requests[i];
+            octetLockState_t prevLock = request.prevState;
+            if ( prevLock == NOTHING_TO_DO ) continue;
+
+            octetLockState_t newLock;
+            Transition transition;
+
+            if ( request.write ) {
+                newLock = WREX( myThreadInfo );
+                transition = IS_RELEASED( prevLock ) ? RELEASED_TO_OWNED :
+                             IS_RDSH( prevLock )     ? RDSH_TO_WREX :
+                             GET_TID( prevLock ) == myThreadInfo ? UPGRADE :
+                             IS_RDEX( prevLock )     ? RDEX_TO_WREX : WREX_TO_WREX;
+            } else if ( IS_RELEASED( prevLock ) ) {
+                newLock = RDEX( myThreadInfo );
+                transition = RELEASED_TO_OWNED;
+            } else if ( IS_RDSH( prevLock ) ) {
+                newLock = prevLock | myBit;
+                transition = RDSH_TO_RDSH;
+            } else if ( IS_RDEX( prevLock ) ) {
+                newLock = RDSH( GET_TID( prevLock )->readerBit_ | myBit );
+                transition = RDEX_TO_RDSH;
+            } else {
+                newLock = RDEX( myThreadInfo );
+                transition = WREX_TO_RDEX;
+            }
+
+            unlockIntermediate( request.lock, newLock );
+
+            noteTransition( request.statistics, sampleTimer, request.lock, prevLock, transition );
+        }
+    }
+
+    // mustAcquire
+    //
+    //   Checks whether we still need to acquire the requested lock
+    //       the long way, and if not, marks the request as NOTHING_TO_DO.
+    //       (Unowned and released locks we just take.)
+    //
+    static bool mustAcquire( LockRequest& request )
+    {
+        if ( holds( request.lock, request.write ) ) {
+            request.prevState = NOTHING_TO_DO;
+            return false;
+        }
+
+        if ( request.statistics ) {
+            bump( request.write ? myThreadInfo->stats_.slowWrites
+                                : myThreadInfo->stats_.slowReads );
+        }
+
+        octetLockState_t newState = request.write ? WREX( myThreadInfo ) : RDEX( myThreadInfo );
+
+        if ( request.statistics ? takeReleased<DefaultPolicy, true>( request.lock, newState )
+                                : takeReleased<DefaultPolicy, false>( request.lock, newState ) ) {
+            request.prevState = NOTHING_TO_DO;
+            return false;
+        }
+
+        return true;
+    }
+
+    // acquireBatch
+    //
+    //   The slow path of acquireAll (see octet-core.hpp): acquires all
+    //       the requested locks that we don't already hold.
+    //
+    //   On a multiprocessor we take them all in one group (sorted, and
+    //       with duplicates merged), so a batch costs about one round
+    //       trip rather than one per lock.
+    //
+    //   On a uniprocessor the owners can only get to their safe points
+    //       one after another anyway, and holding several INTERMEDIATE
+    //       locks while they do just stalls them (and us) further; in
+    //       stresstest, it turns an occasional round trip into one
+    //       nearly every iteration. So there we take the locks one at a
+    //       time, in the order given, as lock() always used to.
+    //
+    //   Returns whether we lost any of these locks along the way (in
+    //       which case the caller should try again; the ones we still
+    //       hold will take the fast path). Locks stay INTERMEDIATE until
+    //       their whole group is done, so we can only lose them by
+    //       granting requests afterwards, while we wait for the rest.
+    //
+    bool acquireBatch( LockRequest* requests, size_t n )
+    {
+        TRACE("Thread 0x%x acquiring a batch of %u locks\n", myThreadInfo, (unsigned) n);
+
+        bool restart = false;
+        bool holding = false;
+
+        // Memory order: see writeSlowPath.
+        octetCount_t requestsBefore =
+        countOf( myThreadInfo->responses_.load( MEM_ORD( std::memory_order_relaxed ) ) );
+
+        if ( multiprocessor ) {
+
+            std::sort( requests, requests + n,
+                       []( const LockRequest& a, const LockRequest& b ) {
+                           return std::less<octetLock_t*>()( a.lock, b.lock );
+                       } );
+
+            // Merge duplicates into the first copy.
+            size_t first = 0;
+            for (size_t i = 0; i < n; ++i) {
+                requests[i].prevState = 0;
+
+                if ( i > 0 && requests[i].lock == requests[first].lock ) {
+                    requests[first].write |= requests[i].write;
+                    requests[first].statistics |= requests[i].statistics;
+                    requests[i].prevState = NOTHING_TO_DO;
+                } else {
+                    first = i;
+                }
+            }
+
+            bool statistics = false;
+            for (size_t i = 0; i < n; ++i) {
+                if ( requests[i].prevState == NOTHING_TO_DO ) continue;
+
+                if ( mustAcquire( requests[i] ) ) {
+                    statistics |= requests[i].statistics;
+                } else {
+                    holding = true;
+                }
+            }
+
+            if ( statistics ) {
+                acquireGroup<true>( requests, n );
+            } else {
+                acquireGroup<false>( requests, n );
+            }
+
+            // Memory order: see above.
+            octetCount_t requestsAfter =
+            countOf( myThreadInfo->responses_.load( MEM_ORD( std::memory_order_relaxed ) ) );
+
+            restart = holding && requestsBefore != requestsAfter;
+
+        } else {
+
+            for (size_t i = 0; i < n; ++i) {
+                requests[i].prevState = 0;
+
+                if ( mustAcquire( requests[i] ) ) {
+                    if ( requests[i].statistics ) {
+                        acquireGroup<true>( requests + i, 1 );
+                    } else {
+                        acquireGroup<false>( requests + i, 1 );
+                    }
+
+                    // Memory order: see above.
+                    octetCount_t requestsAfter =
+                    countOf( myThreadInfo->responses_.load( MEM_ORD( std::memory_order_relaxed ) ) );
+
+                    restart |= holding && requestsBefore != requestsAfter;
+                    requestsBefore = requestsAfter;
+                }
+
+                holding = true;
+            }
+        }
+
+        // Granting some request doesn't mean we gave up one of *these*
+        //    locks, so check. (We're not at a safe point now, so none of
+        //    them can be taken from us before the caller gets to use them.)
+        if ( restart ) {
+            restart = false;
+            for (size_t i = 0; i < n; ++i) {
+                if ( ! holds( requests[i].lock, requests[i].write ) ) {
+                    TRACE("Thread 0x%x lost 0x%x while acquiring the batch\n",
+                          myThreadInfo, requests[i].lock);
+                    restart = true;
+                    break;
+                }
+            }
+        }
+
+        TRACE("Thread 0x%x acquired the batch\n", myThreadInfo);
+
+        return restart;
+    }
 
     // yield
     //
@@ -519,42 +2060,45 @@ namespace octet {
     // noThreadInfo
     //
     // Returns the OctetThreadInfo for a designated "dead" thread,
-    // who is considered the owner of all newly created locks.
+    // who is considered to have released all unowned locks.
     //
     OctetThreadInfo* noThreadInfo()
     {
         // Create the illusion of a terminated (permanently blocked) thread.
         // Note: C++11 guarantees that only one thread will initialize this
         //       resource
-        static OctetThreadInfo* nti = new OctetThreadInfo( true );
+        static OctetThreadInfo* nti = [] {
+            OctetThreadInfo* info = new OctetThreadInfo( true );
+            setId( info, 1 );
+            return info;
+        }();
         return nti;
     }
 
-    Lock::Lock() :
-       lk_( WREX( noThreadInfo() ) )
-    {
-       // Nothing else to do
-    }
-
-
-    void Lock::forceUnlock()
+    // forceUnlock
+    //
+    // Gives up the lock (if we still have it), as if our thread had died.
+    //
+    void forceUnlock( octetLock_t* objLock )
     {
         // We can't just overwrite the lock with the "unlocked"
         // bit pattern, because another thread might have marked
-        // it INTERMEDIATE. Or it might be in a RDSH state.
+        // it INTERMEDIATE. Or it might be in a RdSh state.
         // Or we might have unlocked it previously, and another
         // thread has already claimed it.
 
-        octetLockState_t unlocked = WREX( noThreadInfo() );
+        octetLockState_t unlocked = unownedState();
 
 
-        octetLockState_t objLock =
-           lk_.load( MEM_ORD( std::memory_order_relaxed ) );
+        octetLockState_t curLock =
+           loadLock( objLock MEM_ORD(, std::memory_order_relaxed) );
 
-        // Assumes GET_TID returns non-pointer value for RDSH, INTERMEDIATE
-        if ( GET_TID(objLock) == myThreadInfo ) {
+        if ( OWNED_BY_ME(curLock) ) {
             // Best effort attempt to unlock
-            lk_.compare_exchange_strong( objLock, unlocked ) ;
+            //
+            // Memory order: the next owner takes it with takeReleased,
+            //    so this needs to be (at least) a release.
+            compareExchangeLockStrong( objLock, curLock, unlocked ) ;
         }
     }
 
@@ -13,30 +13,406 @@
 #ifndef OCTET_HPP_INCLUDED
 #define OCTET_HPP_INCLUDED
 
+#include <cassert>
+#include <memory>
+#include <vector>
+
 #include "octet-core.hpp"
 
 namespace octet {
 
-    class Lock {
+    // BasicLock
+    //
+    //     A lock configured by Policy (see LockPolicy in octet-core.hpp).
+    //     Locks with different policies can be mixed freely.
+    //     E.g., BasicLock< LockPolicy<false> > is an exclusive-only lock,
+    //     and BasicLock< LockPolicy<true, true> > a read-shared lock that
+    //     gathers statistics.
+    //
+    template <typename Policy = DefaultPolicy>
+    class BasicLock {
 
         octetLock_t lk_;
 
     public:
-        Lock();
+        // Newly created locks are unowned, and free for the taking.
+        BasicLock() : lk_( unownedState() ) {}
+
+        bool readLock()  { return readBarrier<Policy> ( &lk_ ); }
+        bool writeLock() { return writeBarrier<Policy> ( &lk_ ); }
+
+        // For acquiring several locks at once (see acquireAll in octet-core.hpp).
+        LockRequest request( bool lockForWriting )
+        {
+            return makeRequest<Policy>( &lk_, lockForWriting );
+        }
+
+        // Done with the lock for now (see releaseLock in octet-core.hpp).
+        void release() { releaseLock( &lk_ ); }
+
+        void forceUnlock() { octet::forceUnlock( &lk_ ); }
+
+        // Whether we already hold the lock well enough to read (or write)
+        //    it, i.e., whether readLock (or writeLock) would be a fast path.
+        bool holds( bool forWriting ) { return octet::holds<Policy>( &lk_, forWriting ); }
+    };
+
+    // Lock
+    //
+    //     A lock configured by the #defines in octet-core.hpp.
+    //
+    using Lock = BasicLock<>;
+
+    // BasicIntrusiveLock
+    //
+    //     A lock kept in half of a 64-bit atomic word the caller already
+    //     has (say, a node's version number or 32-bit link), so it costs
+    //     no memory of its own and sits on the same cache line as the data.
+    //     LockInHighHalf says which half of the word's value the lock
+    //     takes (LOCK_BITS). The rest (DATA_BITS) is still the caller's,
+    //     and guarded by the lock like any other data.
+    //
+    //     Octet only changes the word with a compare_exchange of the whole
+    //     word that leaves DATA_BITS as they were, and the caller must do
+    //     the same for LOCK_BITS: load the word as it likes, but change it
+    //     only with setData, compareExchangeData, or a compare_exchange of
+    //     its own whose new value has the LOCK_BITS it expected. (A plain
+    //     store could undo a lock transition another thread just made.)
+    //
+    //     Requires 32-bit lock states (OCTET_COMPACT_LOCKS, or a 32-bit
+    //     machine), since pointer-sized ones need the whole word. Apart
+    //     from a check of the pointer in compact builds, ordinary locks
+    //     don't pay for intrusive ones; intrusive ones may have to retry
+    //     a lock transition if the caller's bits change under it.
+    //
+    //     This is just a view of the word, as cheap to make as a pointer.
+    //     The word must start out as initialValue(...).
+    //
+    template <typename Policy = DefaultPolicy, bool LockInHighHalf = true>
+    class BasicIntrusiveLock {
+
+        // (Mentions Policy so that it's only checked if the class is used.)
+        static_assert( INTRUSIVE_LOCKS || sizeof(Policy) == 0,
+                       "intrusive locks need 32-bit lock states (OCTET_COMPACT_LOCKS)" );
+
+        static const unsigned LOCK_SHIFT = LockInHighHalf ? 32 : 0;
+
+        std::atomic<uint64_t>* word_;
+
+        // (Tagged, so that the library looks in the word; see isIntrusive
+        //    in octet-core.hpp.)
+        octetLock_t* lk() const
+        {
+            return reinterpret_cast<octetLock_t*>(
+                reinterpret_cast<uintptr_t>( word_ ) | INTRUSIVE_LOCK |
+                (LockInHighHalf ? INTRUSIVE_HIGH : 0) );
+        }
+
+    public:
+        static const uint64_t LOCK_BITS = static_cast<uint64_t>( 0xffffffff ) << LOCK_SHIFT;
+        static const uint64_t DATA_BITS = ~LOCK_BITS;
+
+        explicit BasicIntrusiveLock( std::atomic<uint64_t>& word ) : word_( &word ) {}
+
+        // The value for a word whose lock is unowned (cf. BasicLock's
+        //    constructor), and whose DATA_BITS are data's.
+        static uint64_t initialValue( uint64_t data = 0 )
+        {
+            return (data & DATA_BITS) |
+                   (static_cast<uint64_t>( unownedState() ) << LOCK_SHIFT);
+        }
+
+        bool readLock()  { return readBarrier<Policy> ( lk() ); }
+        bool writeLock() { return writeBarrier<Policy> ( lk() ); }
+
+        LockRequest request( bool lockForWriting )
+        {
+            return makeRequest<Policy>( lk(), lockForWriting );
+        }
+
+        void release() { releaseLock( lk() ); }
+
+        void forceUnlock() { octet::forceUnlock( lk() ); }
+
+        bool holds( bool forWriting ) { return octet::holds<Policy>( lk(), forWriting ); }
+
+        // The caller's bits, in place (with LOCK_BITS zero). (The lock
+        //    provides the ordering, so these accesses don't need to.)
+        uint64_t data() const
+        {
+            return word_->load( std::memory_order_relaxed ) & DATA_BITS;
+        }
+
+        // Replaces the caller's bits with value's.
+        void setData( uint64_t value )
+        {
+            uint64_t cur = word_->load( std::memory_order_relaxed );
+            while ( ! word_->compare_exchange_weak( cur, (cur & LOCK_BITS) | (value & DATA_BITS),
+                                                    std::memory_order_relaxed ) ) {
+                // Try again (cur was updated)
+            }
+        }
+
+        // Replaces the caller's bits with desired's if they're still
+        //    expected's (whatever the lock does meanwhile), and returns
+        //    true; otherwise sets expected to them, and returns false.
+        bool compareExchangeData( uint64_t& expected, uint64_t desired )
+        {
+            uint64_t cur = word_->load( std::memory_order_relaxed );
+            while ( (cur & DATA_BITS) == (expected & DATA_BITS) ) {
+                if ( word_->compare_exchange_weak( cur, (cur & LOCK_BITS) | (desired & DATA_BITS),
+                                                   std::memory_order_relaxed ) ) {
+                    return true;
+                }
+            }
+            expected = cur & DATA_BITS;
+            return false;
+        }
+    };
+
+    // IntrusiveLock
+    //
+    //     An intrusive lock configured by the #defines in octet-core.hpp.
+    //
+    using IntrusiveLock = BasicIntrusiveLock<>;
+
+    // LockTableStatistics
+    //
+    //     What a lock table has cost, and how often unrelated keys got in
+    //     each other's way because they share a stripe (only counted if the
+    //     table's Policy gathers statistics).
+    //
+    struct LockTableStatistics {
+        size_t stripes;
+        size_t bytes;               // Memory used by the stripes.
+        uint64_t trueConflicts;     // Taking a stripe from another thread
+                                    //    that was using the same key.
+        uint64_t falseConflicts;    // ... that was using a different key.
+    };
+
+    // BasicLockTable
+    //
+    //     Guards a large population of objects with a fixed number of
+    //     locks ("stripes"), each on its own cache line: every key (or
+    //     object address) maps to one stripe. Fewer stripes use less
+    //     memory, but unrelated keys that share a stripe conflict with
+    //     each other; see getStatistics.
+    //
+    template <typename Policy = DefaultPolicy>
+    class BasicLockTable {
+
+        static const size_t CACHE_LINE = 64;
+
+        struct alignas(CACHE_LINE) Stripe {
+            BasicLock<Policy> lock_;
+
+            // For the statistics: who last used the stripe, and how.
+            std::atomic<uintptr_t> lastKey_;
+            std::atomic<OctetThreadInfo*> lastUser_;
+            std::atomic<bool> lastWrite_;
+            std::atomic<uint64_t> trueConflicts_;
+            std::atomic<uint64_t> falseConflicts_;
+
+            Stripe() : lastKey_(0), lastUser_(nullptr), lastWrite_(false),
+                       trueConflicts_(0), falseConflicts_(0) {}
+        };
+
+        // (Over-allocated by a line, so that the stripes can be aligned.)
+        std::unique_ptr<char[]> storage_;
+        Stripe* stripes_;
+        size_t mask_;
+        unsigned shift_;
+
+        void noteUser( Stripe& s, uintptr_t key, bool write );
+
+    public:
+        // Rounds the number of stripes up to a power of two.
+        //    (Each takes a cache line.)
+        explicit BasicLockTable( size_t stripes );
+        ~BasicLockTable();
+
+        BasicLockTable( const BasicLockTable& ) = delete;
+        BasicLockTable& operator=( const BasicLockTable& ) = delete;
+
+        size_t stripes() const { return mask_ + 1; }
+
+        // The stripe for a key (Fibonacci hashing, so that keys and
+        //    addresses with regular strides still spread out).
+        size_t stripeIndex( uintptr_t key ) const
+        {
+            return static_cast<size_t>(
+                (static_cast<uint64_t>( key ) * 0x9E3779B97F4A7C15ull) >> shift_ ) & mask_;
+        }
+
+        BasicLock<Policy>& forKey( uintptr_t key )
+        {
+            return stripes_[ stripeIndex( key ) ].lock_;
+        }
+
+        BasicLock<Policy>& forObject( const void* object )
+        {
+            return forKey( reinterpret_cast<uintptr_t>( object ) );
+        }
+
+        bool readLock( uintptr_t key )
+        {
+            Stripe& s = stripes_[ stripeIndex( key ) ];
+            bool lost = s.lock_.readLock();
+            if ( Policy::statistics ) noteUser( s, key, false );
+            return lost;
+        }
 
-        bool readLock()  { return readBarrier ( &lk_ ); }
-        bool writeLock() { return writeBarrier ( &lk_ ); }
+        bool writeLock( uintptr_t key )
+        {
+            Stripe& s = stripes_[ stripeIndex( key ) ];
+            bool lost = s.lock_.writeLock();
+            if ( Policy::statistics ) noteUser( s, key, true );
+            return lost;
+        }
 
-        void forceUnlock();
+        void release( uintptr_t key ) { forKey( key ).release(); }
+
+        // Acquires several keys at once (like octet::lock): [first, last)
+        //    is a (forward) range of pairs, such as std::pair<uintptr_t, bool>,
+        //    giving each key and whether to lock it for writing. Keys that
+        //    share a stripe are fine.
+        template <typename Iterator>
+        void lock( Iterator first, Iterator last );
+
+        LockTableStatistics getStatistics() const;
     };
 
+    // LockTable
+    //
+    //     A lock table configured by the #defines in octet-core.hpp.
+    //
+    using LockTable = BasicLockTable<>;
+
     // yield
     //
     //     Calling this makes you a good citizen,
     //     because it checks to see if anyone is waiting for
-    //     one of our locks.
+    //     one of our locks. (See also poll, in octet-core.hpp,
+    //     which is cheaper when nobody is.)
     void yield();
 
+    // BlockedScope
+    //
+    //     Marks the thread as blocked (say, around read(), epoll_wait or
+    //     a condition variable wait) for as long as the object exists.
+    //     Meanwhile, threads that want its locks just take them, rather
+    //     than waiting for it to wake up and respond. Like AsyncSafeScope
+    //     (below), the thread mustn't touch data guarded by octet locks,
+    //     or call octet, while blocked. Scopes can't be nested.
+    //
+    class BlockedScope {
+
+        octetCount_t responses_;
+        bool active_;
+
+    public:
+        BlockedScope()
+        : responses_( myThreadInfo->responses_.load( std::memory_order_relaxed ) ),
+          active_( true )
+        {
+            myThreadInfo->handleRequests( true );
+        }
+
+        ~BlockedScope() { if ( active_ ) leave(); }
+
+        BlockedScope( const BlockedScope& ) = delete;
+        BlockedScope& operator=( const BlockedScope& ) = delete;
+
+        // Unblocks early. Returns whether we granted any requests on the
+        //    way in, or while blocked (and so may have lost locks).
+        bool leave()
+        {
+            active_ = false;
+            myThreadInfo->unblock();
+
+            octetCount_t responses =
+                myThreadInfo->responses_.load( std::memory_order_relaxed );
+            return ((responses ^ responses_) & ~static_cast<octetCount_t>( 1 )) != 0;
+        }
+    };
+
+    // blocking
+    //
+    //     Calls f() (e.g., a lambda wrapping a system call) in a
+    //     BlockedScope, and returns its result. If lost isn't null,
+    //     sets *lost to whether we may have lost locks meanwhile.
+    //
+    //         ssize_t n = octet::blocking( [&]{ return read( fd, buf, len ); } );
+    //
+    template <typename F>
+    auto blocking( F&& f, bool* lost = nullptr ) -> decltype( f() );
+
+    // Response signals
+    //
+    //     A thread only grants requests for its locks at a safe point
+    //     (yield, poll, its own slow paths, or when it exits), so one
+    //     that spends a long time computing makes everyone who wants one
+    //     of its locks wait just as long. If it can't conveniently poll,
+    //     it can instead mark the computation as an AsyncSafeScope, and
+    //     a thread that has waited too long for it sends it a signal,
+    //     whose handler grants the requests at once.
+
+    // setResponseSignal
+    //
+    //     After waiting afterUs microseconds for a response, send signo
+    //     (e.g., SIGRTMIN) to the owner, and again every afterUs until it
+    //     responds. Installs a handler for signo; pass signo = 0 to stop
+    //     sending signals (the handler stays, in case any are in flight).
+    //     Returns false if the signal can't be used. [Linux only.]
+    //
+    bool setResponseSignal( int signo, unsigned afterUs );
+
+    // AsyncSafeScope
+    //
+    //     While one of these exists, the thread promises not to touch
+    //     any data guarded by octet locks, or to call octet, so a
+    //     response signal can grant requests right away. Entering and
+    //     leaving cost a couple of stores (and a poll on the way out).
+    //     Scopes can't be nested.
+    //
+    class AsyncSafeScope {
+
+        octetCount_t responses_;
+        bool active_;
+
+    public:
+        AsyncSafeScope()
+        : responses_( myThreadInfo->responses_.load( std::memory_order_relaxed ) ),
+          active_( true )
+        {
+            assert( ! asyncSafe );
+            std::atomic_signal_fence( std::memory_order_seq_cst );
+            asyncSafe = 1;
+            std::atomic_signal_fence( std::memory_order_seq_cst );
+        }
+
+        ~AsyncSafeScope() { if ( active_ ) leave(); }
+
+        AsyncSafeScope( const AsyncSafeScope& ) = delete;
+        AsyncSafeScope& operator=( const AsyncSafeScope& ) = delete;
+
+        // Ends the scope early. Returns whether we granted any requests
+        //    while in it (and so may have lost locks).
+        bool leave()
+        {
+            std::atomic_signal_fence( std::memory_order_seq_cst );
+            asyncSafe = 0;
+            std::atomic_signal_fence( std::memory_order_seq_cst );
+            active_ = false;
+
+            poll();
+
+            octetCount_t responses =
+                myThreadInfo->responses_.load( std::memory_order_relaxed );
+            return ((responses ^ responses_) & ~static_cast<octetCount_t>( 1 )) != 0;
+        }
+    };
+
     // initPerthread
     //
     //     Should be called once at the beginning of each thread.
@@ -46,16 +422,196 @@ namespace octet {
 
     // shutdownPerthread
     //
-    //     Should be called once at the beginning of each thread.
+    //     Should be called once at the end of each thread.
     //
     void shutdownPerthread();
 
+    // Contexts
+    //
+    //     Locks are really owned by contexts rather than threads.
+    //     initPerthread creates a context and attaches it to the current
+    //     thread, but a thread pool or fiber library can instead manage
+    //     contexts itself, e.g., one per task, and move them between
+    //     worker threads without giving up any of their locks.
+    //
+    //     A detached context is always at a safe point, so a thread that
+    //     wants one of its locks just responds on its behalf; the context
+    //     keeps all its other locks.
+
+    using Context = OctetThreadInfo;
+
+    // createContext
+    //
+    //     Returns a new context, not attached to any thread.
+    //
+    Context* createContext();
+
+    // attachContext
+    //
+    //     Makes ctx the current thread's context. The thread must not
+    //     already have one.
+    //
+    void attachContext( Context* ctx );
+
+    // detachContext
+    //
+    //     Detaches and returns the current thread's context, after
+    //     granting any pending requests. The context keeps its other locks.
+    //
+    Context* detachContext();
+
+    // respondFor
+    //
+    //     Grants pending requests on behalf of a detached context.
+    //     (Requesters do this themselves, so it's rarely necessary.)
+    //     Returns false (doing nothing) if the context is attached,
+    //     since the thread it's attached to is responsible for it.
+    //
+    bool respondFor( Context* ctx );
+
+    // destroyContext
+    //
+    //     Gives up all of a detached context's locks.
+    //     The context must not be used afterwards.
+    //
+    void destroyContext( Context* ctx );
+
+    // Statistics
+    //
+    //     Each context counts barriers, slow paths, and the ways its
+    //     slow paths changed lock states, and keeps histograms of how
+    //     long they waited (see ThreadStats in octet-core.hpp). This
+    //     only happens for locks whose policy has Statistics set
+    //     (e.g., all locks, if STATISTICS is defined), except that
+    //     octet::lock restarts are always counted.
+
+    struct LockStatistics {
+        uint64_t writeBarriers;
+        uint64_t slowWrites;
+        uint64_t readBarriers;
+        uint64_t slowReads;
+        uint64_t transitions[NUM_TRANSITIONS];
+        uint64_t lockRestarts;
+        uint64_t intermediateNs[HISTOGRAM_BUCKETS];
+        uint64_t awaitNs[HISTOGRAM_BUCKETS];
+    };
+
+    // getStatistics
+    //
+    //     Returns the totals over all contexts, past and present.
+    //     Doesn't synchronize with the threads doing the counting, so it's
+    //     cheap enough to call regularly from a monitoring thread; the
+    //     result may be slightly out of date, but no total ever decreases
+    //     from one call to the next.
+    //
+    LockStatistics getStatistics();
+
+    // getStatistics (one context)
+    //
+    //     Returns the counts for a single context. Since contexts are
+    //     recycled, these include the counts of earlier contexts that
+    //     used the same slot.
+    //
+    LockStatistics getStatistics( const Context* ctx );
+
+    // transitionName
+    //
+    //     E.g., "RdEx->RdSh", for reports.
+    //
+    const char* transitionName( Transition t );
+
+    // printStatistics
+    //
+    //     Writes a human-readable summary (with atomic_printf).
+    //
+    void printStatistics( const LockStatistics& stats );
+
+    // Profiling
+    //
+    //     To find locks that bounce between threads, the slow paths can
+    //     sample one in every N lock transitions, recording the lock, its
+    //     previous and new owners, and how long the slow path took. Each
+    //     context keeps its most recent samples. Profiling costs nothing
+    //     on the fast path, and just one load on the slow path when off.
+
+    // setProfileSampling
+    //
+    //     Samples one in every interval slow-path transitions (per
+    //     thread); 0 (the default) turns profiling off.
+    //
+    void setProfileSampling( unsigned interval );
+
+    // Owners in a profile are identified by their contexts' registry
+    //     slots, or by one of these.
+    const int PROFILE_NO_OWNER = -1;  // A new or force-unlocked lock
+    const int PROFILE_READERS  = -2;  // A read-shared lock's readers
+
+    struct OwnerPair {
+        int from;
+        int to;
+        uint64_t samples;
+    };
+
+    struct LockProfile {
+        const void* lock;            // The address of the octet lock.
+        uint64_t samples;
+        uint64_t waitNs;             // Total over all the samples.
+        std::vector<OwnerPair> pairs;   // Most frequent first.
+    };
+
+    // getProfile
+    //
+    //     Summarizes the samples currently recorded, hottest lock
+    //     (most samples) first. Safe to call while other threads run.
+    //
+    std::vector<LockProfile> getProfile();
+
+    // printProfile
+    //
+    //     Writes the hottest locks, and the owners fighting over them
+    //     (with atomic_printf).
+    //
+    void printProfile( unsigned maxLocks = 10 );
+
     // utility functions
     int atomic_printf(const char *format, ...);
 
+    // lock
+    //
+    //     Acquires several locks at once:
+    //         lock(lock1, forWriting1, lock2, forWriting2, ...)
+    //     or, for a set whose size isn't known until run time,
+    //         lock(first, last)
+    //     where [first, last) is a (forward) range of pairs, such as
+    //     std::pair<Lock*, bool>, giving each lock and whether to lock
+    //     it for writing. (Intrusive locks work too, and can be mixed
+    //     with ordinary ones.)
+    //
     template <typename ...Tail>
     void lock(Tail&&... tail);
 
+    template <typename Iterator>
+    void lock(Iterator first, Iterator last);
+
+    // LockScope
+    //
+    //     lock(...) for as long as the object exists, releasing (see
+    //     release, above) each of the locks when it goes away:
+    //         {
+    //             auto scope = lockScope(lock1, forWriting1, lock2, forWriting2);
+    //             ...
+    //         }
+    //     Releasing a lock that isn't hot is just a load, and we keep it as
+    //     usual; hot (pessimistic) ones are handed over without the next
+    //     thread having to ask for them. Like lock(...), this may lose
+    //     other locks on the way in.
+    //
+    template <size_t N>
+    class LockScope;
+
+    template <typename ...Tail>
+    LockScope<sizeof...(Tail) / 2> lockScope(Tail&&... tail);
+
 }
 
 #include "octet-private.hpp"
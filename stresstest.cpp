@@ -12,8 +12,11 @@
  *    At the end, the sum of all accounts should be zero
  *          (if the locks are correctly enforcing mutual exclusion!)
  *
- *  Compile-time flags let us run and time the same test with
- *     octet vs. pthreads (recursive) locks, removing all contention, etc.
+ *  We time each lock call and each iteration, and report percentiles.
+ *
+ *  Command-line options let us run and time the same test with
+ *     octet vs. pthreads (recursive) locks, removing all contention, etc.,
+ *     or (with --matrix) all of the combinations at once.
  *
  * Author: Christopher A. Stone <stone@cs.hmc.edu>
  *
@@ -23,38 +26,123 @@
 // CONTROL FLAGS //
 ///////////////////
 
-// USE_OCTET
-//
-// If 1, we'll use OCTET locking.
-// If 0, we'll use Pthreads (recursive) locks
-
-#define USE_OCTET 1
-
-// DO_YIELD
-//   If 1, we'll do a yield-like step at the end of each iteration.
-//   If 0, we won't.
-//
-//   Note: Octet yield == Grant other threads' pending requests.
-//         Pthreads yield == sched_yield()
-#define DO_YIELD 0
-
-// CONTENTION
-//   If 1, we choose 2-3 random accounts per iteration, randomly
-//   If 0, thread i gets accounts 30i+1
-//              (no contention, and no false (data) sharing.
-//         Make sure there are enough accounts!
-#define CONTENTION 1
-
-// OCTET_UNLOCK
-//    If 1, we set locks to unowned at the end of
-//           each iteration [unless someone else has grabbed them]
-//    If 0, we retain ownership until we get an explicit slow-path request
-//            from another thread.
-//
-#define OCTET_UNLOCK 0
-
-static_assert( !OCTET_UNLOCK || USE_OCTET,
-              "OCTET_UNLOCK only makes sense when we are using Octet barriers");
+// Each mode is chosen on the command line (see usage() below), and the
+//    worker loop is instantiated separately for each combination, so the
+//    choice costs nothing inside the loop.
+
+struct Settings {
+
+    // --octet / --mutex
+    //   Use OCTET locking, or Pthreads (recursive) locks.
+    bool octet = true;
+
+    // --yield
+    //   Do a yield-like step at the end of each iteration.
+    //
+    //   Note: Octet yield == Grant other threads' pending requests.
+    //         Pthreads yield == sched_yield()
+    bool yield = false;
+
+    // How each iteration chooses its 2-3 accounts:
+    //   --uniform (the default)
+    //         At random.
+    //   --no-contention
+    //         Thread i gets accounts 30i, 30i+1 and 30i+2
+    //         (no contention, and no false (data) sharing.
+    //         Make sure there are enough accounts!
+    //   --zipf[=S]
+    //         At random, but account k is chosen with probability
+    //         proportional to 1/(k+1)^S (S defaults to 0.99), so a few
+    //         accounts are hot.
+    //   --hot-set[=N]
+    //         Each thread has N accounts of its own (3 by default, wrapping
+    //         around if there aren't enough), which it picks --locality=P
+    //         percent of the time (90 by default); otherwise, at random.
+    //   --phased[=L]
+    //         As --hot-set, but every L iterations (1000 by default) each
+    //         thread moves on to the next thread's hot set, so ownership
+    //         of the hot accounts keeps migrating.
+    enum Pattern { UNIFORM, DISJOINT, ZIPF, HOT_SET, PHASED };
+    Pattern pattern = UNIFORM;
+    double skew = 0.99;
+    int hotSet = 3;
+    int locality = 90;
+    int phase = 1000;
+
+    // --reads=P
+    //   P percent of the iterations just read their accounts (locking
+    //         all three for reading) instead of moving money.
+    int reads = 0;
+
+    // --unlock   [octet only]
+    //    Set locks to unowned at the end of each iteration
+    //           [unless someone else has grabbed them]
+    //    Otherwise, we retain ownership until we get an explicit slow-path
+    //           request from another thread.
+    bool unlock = false;
+
+    // --release  [octet only]
+    //    Lock with octet::lockScope, which releases the locks at the end
+    //           of each iteration (which only really releases the ones
+    //           that have turned out to be hot; the rest remain biased
+    //           towards us)
+    bool release = false;
+
+    // --profile=N  [octet only]
+    //    If N > 0, sample 1 in N lock transitions and report the
+    //       hottest locks at the end (see octet::setProfileSampling).
+    int profile = 0;
+
+    // --busy-owner=N
+    //    If N > 0, thread 0 computes for about N microseconds (without touching
+    //       the accounts, or yielding) at the end of each iteration, and the
+    //       latencies we report are the other threads'.
+    // --busy-mode=M  [octet only]
+    //    How thread 0 lets the others have its locks in the mean time:
+    //       0: it doesn't (they wait for its next slow path)
+    //       1: it calls octet::poll() as it computes
+    //       2: the computation is an octet::AsyncSafeScope, and a thread that
+    //          has waited RESPONSE_SIGNAL_US microseconds sends it a signal
+    int busyOwner = 0;
+    int busyMode = 0;
+
+    // --sleep=N
+    //    If N > 0, every thread sleeps for about N microseconds at the end
+    //       of each iteration, as if waiting for I/O (but without an
+    //       octet::BlockedScope), so a thread that wants its locks has to
+    //       wait for it to wake up, unless they've been released.
+    int sleep = 0;
+
+    // --lock-set=N  [octet only]
+    //    Instead of three accounts, each iteration locks a set of 2 to N
+    //       distinct accounts (chosen at random) at once, with
+    //       octet::lock(first, last), and moves money between the ones
+    //       it locked for writing (every other one). Sets of more than 16
+    //       take lock's heap path.
+    int lockSet = 0;
+
+    // --blocking=N  [octet only]
+    //    Instead of three accounts, each iteration locks two and moves
+    //       money between them, and then, still holding them, makes a
+    //       blocking call (sleeping about N microseconds in
+    //       octet::blocking), so other threads can take them meanwhile.
+    //       Afterwards it moves money again, locking them again first
+    //       only if octet::blocking says they may have been lost.
+    int blocking = 0;
+
+    // --intrusive[=high|low]  [octet only, and OCTET_COMPACT_LOCKS builds only]
+    //    Each account is a single 64-bit word, with its lock (an
+    //       octet::BasicIntrusiveLock) in the high half (by default) or the
+    //       low half, and its balance in the other. Iterations are as
+    //       usual (uniform, all writes), except that they update the
+    //       balances through setData and compareExchangeData, while other
+    //       threads may be changing the lock half of the same word.
+    int intrusive = 0;    // 0: no; 1: lock in the high half; 2: the low half
+};
+
+const unsigned RESPONSE_SIGNAL_US = 50;
+
+const char* const PATTERN_NAMES[] = { "uniform", "disjoint", "zipf", "hot-set", "phased" };
 
 ////////////////////////
 // CONTROL PARAMETERS //
@@ -70,152 +158,1061 @@ int NUM_ACCOUNTS = 10;           // How many accounts the threads are choosing f
 
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <csignal>
 #include <ctime>
 #include <unistd.h>
 #include <chrono>
 #include <iomanip>
 #include <iostream>
+#include <mutex>
 #include <random>
+#include <sstream>
 #include <string>
 #include <thread>
+#include <tuple>
+#include <utility>
+#include <type_traits>
 #include <vector>
 
-#if USE_OCTET
 #include "octet.hpp"
-#else
-#include <mutex>
-#endif
 
 
 
-// A lockable integer.
+// A lockable integer, and how to use its lock.
+
+struct OctetAccount {
+    static const bool OCTET = true;
 
-struct Account {
     volatile int balance_;
-#if USE_OCTET
     octet::Lock lock_;
-#else
+
+    OctetAccount() : balance_(0) {}
+
+    static void startThread() { octet::initPerthread(); }
+    static void endThread()   { octet::shutdownPerthread(); }
+
+    // Whether lock() will be a fast path (unless some other thread
+    //    asks for one of the locks in the mean time).
+    static bool held(OctetAccount& from, OctetAccount& to, OctetAccount& extra,
+                     bool write)
+    {
+        return from.lock_.holds(write) && to.lock_.holds(write) && extra.lock_.holds(false);
+    }
+
+    // Just locks (and keeps) the accounts.
+    struct Kept {
+        template <typename ...Args>
+        explicit Kept(Args&&... args) { octet::lock(std::forward<Args>(args)...); }
+    };
+
+    // What lock() returns: with Release, a scope that releases the
+    //    accounts when it ends.
+    template <bool Release>
+    using Held = typename std::conditional<Release, octet::LockScope<3>, Kept>::type;
+
+    // from and to locked for writing (or just reading); extra locked for reading.
+    template <bool Release>
+    static Held<Release> lock(OctetAccount& from, OctetAccount& to, OctetAccount& extra,
+                              bool write)
+    {
+        return Held<Release>(from.lock_,  write,
+                             to.lock_,    write,
+                             extra.lock_, false);
+    }
+
+    template <bool Unlock>
+    static void done(OctetAccount& from, OctetAccount& to, OctetAccount& extra)
+    {
+        if (Unlock) {
+            to.lock_.forceUnlock();
+            from.lock_.forceUnlock();
+            extra.lock_.forceUnlock();
+        }
+    }
+
+    // Optional (be a good citizen)
+    static void yield() { octet::yield(); }
+};
+
+struct MutexAccount {
+    static const bool OCTET = false;
+
+    volatile int balance_;
+
     // We use recursive_mutex rather than mutex, because
     //  extra might equal from or to.
     std::recursive_mutex lock_;
-#endif
 
-    Account() : balance_(0) {}
+    MutexAccount() : balance_(0) {}
+
+    static void startThread() {}
+    static void endThread()   {}
+
+    // (Every lock call counts as a slow path.)
+    static bool held(MutexAccount&, MutexAccount&, MutexAccount&, bool) { return false; }
+
+    // Unlocks the accounts when it goes away.
+    using Guard = std::unique_lock<std::recursive_mutex>;
+    using Held = std::tuple<Guard, Guard, Guard>;
+
+    // (Readers lock exclusively too.)
+    template <bool>
+    static Held lock(MutexAccount& from, MutexAccount& to, MutexAccount& extra, bool)
+    {
+        std::lock(from.lock_,
+                  to.lock_,
+                  extra.lock_);
+
+        return Held(Guard(from.lock_, std::adopt_lock),
+                    Guard(to.lock_, std::adopt_lock),
+                    Guard(extra.lock_, std::adopt_lock));
+    }
+
+    template <bool>
+    static void done(MutexAccount&, MutexAccount&, MutexAccount&) {}
+
+    static void yield() { std::this_thread::yield(); }
 };
 
 
-Account* accounts;
+// A log-linear histogram of latencies in nanoseconds: exact below 16ns,
+//    and then 16 buckets per power of two (so within about 6%).
+//    Fixed-size, so recording never allocates.
+struct Histogram {
+    static const int SUB_BITS = 4;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    static const int BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+    uint64_t counts[BUCKETS];
+    uint64_t total;
+    uint64_t max;
+
+    Histogram() : counts(), total(0), max(0) {}
+
+    static int bucket(uint64_t ns)
+    {
+        if (ns < SUB_BUCKETS) return int(ns);
+        int log = 63 - __builtin_clzll(ns);
+        return (log - SUB_BITS + 1) * SUB_BUCKETS
+               + int((ns >> (log - SUB_BITS)) & (SUB_BUCKETS - 1));
+    }
+
+    // The smallest latency that goes in the given bucket.
+    static uint64_t lowest(int b)
+    {
+        if (b < SUB_BUCKETS) return b;
+        int log = b / SUB_BUCKETS + SUB_BITS - 1;
+        return uint64_t(SUB_BUCKETS + b % SUB_BUCKETS) << (log - SUB_BITS);
+    }
+
+    void record(uint64_t ns)
+    {
+        ++counts[bucket(ns)];
+        ++total;
+        if (ns > max) max = ns;
+    }
+
+    void merge(const Histogram& other)
+    {
+        for (int b = 0; b < BUCKETS; ++b) counts[b] += other.counts[b];
+        total += other.total;
+        max = std::max(max, other.max);
+    }
+
+    // The latency that p percent of the samples are no slower than
+    //    (rounded up to the top of its bucket).
+    uint64_t percentile(double p) const
+    {
+        uint64_t rank = std::max(uint64_t(1), uint64_t(std::ceil(p / 100 * total)));
+        uint64_t seen = 0;
+        for (int b = 0; b < BUCKETS; ++b) {
+            seen += counts[b];
+            if (seen >= rank) {
+                return b + 1 < BUCKETS ? std::min(max, lowest(b + 1) - 1) : max;
+            }
+        }
+        return max;
+    }
+};
+
+// Latencies of lock calls and of whole iterations, split by whether the
+//    locks were all already held (the fast path) or not.
+struct Latency {
+    Histogram lock[2];        // [0] fast path, [1] slow path
+    Histogram iteration[2];
+    char padding[64];         // Keep threads' histograms off each other's lines
+
+    void merge(const Latency& other)
+    {
+        for (int slow = 0; slow < 2; ++slow) {
+            lock[slow].merge(other.lock[slow]);
+            iteration[slow].merge(other.iteration[slow]);
+        }
+    }
+};
+
+// Each thread's latencies.
+std::vector<Latency> latency;
+
+// Computes for the given number of microseconds, as thread 0.
+template <int BusyMode>
+void busyWork(int us)
+{
+    auto until = std::chrono::steady_clock::now() + std::chrono::microseconds(us);
+
+    if (BusyMode == 2) {
+        octet::AsyncSafeScope safe;
+        while (std::chrono::steady_clock::now() < until) {}
+        return;
+    }
+
+    while (std::chrono::steady_clock::now() < until) {
+        if (BusyMode == 1) octet::poll();
+    }
+}
+
+// Access patterns (see Settings::pattern). Each thread has its own,
+//    whose pick() chooses the accounts for iteration i. setUp() prepares
+//    anything they share, before the threads start.
+
+struct Uniform {
+    std::uniform_int_distribution<int> dis;
+
+    Uniform(int, const Settings&) : dis(0, NUM_ACCOUNTS-1) {}
+
+    static void setUp(const Settings&) {}
+
+    void pick(std::default_random_engine& engine, int, int& from, int& to, int& extra)
+    {
+        from  = dis(engine);
+        to    = dis(engine);
+        extra = dis(engine);
+    }
+};
+
+struct Disjoint {
+    int first;
+
+    Disjoint(int threadNum, const Settings&) : first(30*threadNum)
+    {
+        assert (first + 2 < NUM_ACCOUNTS);
+    }
+
+    static void setUp(const Settings&) {}
+
+    void pick(std::default_random_engine&, int, int& from, int& to, int& extra)
+    {
+        from  = first;
+        to    = first + 1;
+        extra = first + 2;
+    }
+};
+
+// The chance that a Zipf pick is account k or lower, for each k.
+std::vector<double> zipfCdf;
+
+struct Zipf {
+    std::uniform_real_distribution<double> dis;
+
+    Zipf(int, const Settings&) : dis(0.0, 1.0) {}
+
+    static void setUp(const Settings& settings)
+    {
+        zipfCdf.resize(NUM_ACCOUNTS);
+        double total = 0;
+        for (int k = 0; k < NUM_ACCOUNTS; ++k) {
+            total += std::pow(k + 1, -settings.skew);
+            zipfCdf[k] = total;
+        }
+        for (double& p : zipfCdf) p /= total;
+    }
+
+    int pickOne(std::default_random_engine& engine)
+    {
+        auto k = std::lower_bound(zipfCdf.begin(), zipfCdf.end(), dis(engine));
+        return std::min(NUM_ACCOUNTS - 1, int(k - zipfCdf.begin()));
+    }
+
+    void pick(std::default_random_engine& engine, int, int& from, int& to, int& extra)
+    {
+        from  = pickOne(engine);
+        to    = pickOne(engine);
+        extra = pickOne(engine);
+    }
+};
+
+// HotSet<false> is --hot-set, and HotSet<true> is --phased.
+template <bool Migrate>
+struct HotSet {
+    int threadNum;
+    int size;
+    int locality;
+    int phase;
+    std::uniform_int_distribution<int> all;
+    std::uniform_int_distribution<int> hot;
+    std::uniform_int_distribution<int> percent;
+
+    HotSet(int threadNum, const Settings& settings)
+        : threadNum(threadNum),
+          size(std::min(settings.hotSet, NUM_ACCOUNTS)),
+          locality(settings.locality),
+          phase(settings.phase),
+          all(0, NUM_ACCOUNTS-1),
+          hot(0, size-1),
+          percent(0, 99)
+    {}
+
+    static void setUp(const Settings&) {}
+
+    int pickOne(std::default_random_engine& engine, int first)
+    {
+        return percent(engine) < locality ? (first + hot(engine)) % NUM_ACCOUNTS
+                                          : all(engine);
+    }
+
+    void pick(std::default_random_engine& engine, int i, int& from, int& to, int& extra)
+    {
+        // Whose hot set we're using in this phase.
+        int owner = Migrate ? (threadNum + i / phase) % NUM_THREADS : threadNum;
+        int first = int((long long) owner * size % NUM_ACCOUNTS);
+
+        from  = pickOne(engine, first);
+        to    = pickOne(engine, first);
+        extra = pickOne(engine, first);
+    }
+};
+
 
 // Futzes with the accounts array.
-//   Repeatedly picks three elements
+//   Repeatedly picks three elements (as the Pattern says)
 //      increments one, decrements another, reads a third
 //        (although the read account might overlap with one of
 //         the first two)
-void futz(int threadNum)
+//      or, for the --reads percentage, just reads all three.
+//   BusyMode is -1 unless there's a busy owner; Reads is false when
+//      --reads is 0, so the usual all-writes run doesn't roll the dice;
+//      and Sleep is false unless there's a --sleep.
+template <typename Account, bool Yield, typename Pattern, bool Unlock, bool Release,
+          int BusyMode, bool Reads, bool Sleep>
+void futz(Account* accounts, int threadNum, Settings settings)
 {
+    Account::startThread();
 
-#if USE_OCTET
-    octet::initPerthread();
-    // octet::atomic_printf("Starting thread %d: 0x%x\n", threadNum, myThreadInfo);
-#endif
+    std::default_random_engine engine(100*threadNum);
+    std::uniform_int_distribution<int> percent(0,99);
+    Pattern pattern(threadNum, settings);
+
+    Latency& myLatency = latency[threadNum];
+
+    for (int i = 0; i < NUM_ITERATIONS; ++i) {
+        int from, to, extra;
+        pattern.pick(engine, i, from, to, extra);
+
+        // The read-modify-write code below doesn't work when (from==to).
+        if (from == to) {--i; continue; }
+
+
+        //////////////////
+        // Lock the three accounts
+        /////////////////
+
+        bool write = ! Reads || percent(engine) >= settings.reads;
+
+        bool slow = ! Account::held(accounts[from], accounts[to], accounts[extra], write);
+
+        auto start = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point locked;
+
+        {
+            auto held = Account::template lock<Release>(accounts[from], accounts[to],
+                                                        accounts[extra], write);
+            (void) held;
+
+            locked = std::chrono::steady_clock::now();
+
+
+            /////////////////////////////
+            // READ-MODIFY-WRITE sequence
+            /////////////////////////////
+
+            int from_balance = accounts[from].balance_;
+            int to_balance = accounts[to].balance_;
+
+            if (write) {
+                --from_balance;
+                ++to_balance;
+
+                accounts[to].balance_= to_balance;
+                accounts[from].balance_ = from_balance;
+            } else {
+                (void) accounts[extra].balance_;
+            }
+
+            Account::template done<Unlock>(accounts[from], accounts[to], accounts[extra]);
+
+        }   // (The mutexes are unlocked here; with --release, so are hot octet locks.)
+
+        if (Yield) Account::yield();
+
+        if (BusyMode >= 0 && threadNum == 0) busyWork<BusyMode>(settings.busyOwner);
+
+        if (Sleep) std::this_thread::sleep_for(std::chrono::microseconds(settings.sleep));
+
+        auto end = std::chrono::steady_clock::now();
+
+        myLatency.lock[slow].record(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(locked - start).count());
+        myLatency.iteration[slow].record(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+    }
+
+    Account::endThread();
+}
+
+
+// Like futz, but with --lock-set: locks 2 to settings.lockSet distinct
+//   accounts at once, through the iterator version of octet::lock,
+//   writing every other one (so the rest are just read), and moves one
+//   unit from the first writable account to each of the others.
+void futzSet(OctetAccount* accounts, int threadNum, Settings settings)
+{
+    OctetAccount::startThread();
+
+    std::default_random_engine engine(100*threadNum);
+    std::uniform_int_distribution<int> size(2, settings.lockSet);
+
+    Latency& myLatency = latency[threadNum];
+
+    std::vector<int> chosen(NUM_ACCOUNTS);
+    for (int k = 0; k < NUM_ACCOUNTS; ++k) chosen[k] = k;
+
+    std::vector<std::pair<octet::Lock*, bool>> set;
+
+    for (int i = 0; i < NUM_ITERATIONS; ++i) {
+        int n = size(engine);
+
+        // The first n of chosen become a random sample.
+        for (int k = 0; k < n; ++k) {
+            std::uniform_int_distribution<int> rest(k, NUM_ACCOUNTS-1);
+            std::swap(chosen[k], chosen[rest(engine)]);
+        }
+
+        set.clear();
+        bool slow = false;
+        for (int k = 0; k < n; ++k) {
+            bool write = k % 2 == 0;
+            set.emplace_back(&accounts[chosen[k]].lock_, write);
+            slow |= ! accounts[chosen[k]].lock_.holds(write);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+
+        octet::lock(set.begin(), set.end());
+
+        auto locked = std::chrono::steady_clock::now();
+
+        for (int k = 2; k < n; k += 2) {
+            --accounts[chosen[0]].balance_;
+            ++accounts[chosen[k]].balance_;
+        }
+        for (int k = 1; k < n; k += 2) {
+            (void) accounts[chosen[k]].balance_;
+        }
+
+        auto end = std::chrono::steady_clock::now();
+
+        myLatency.lock[slow].record(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(locked - start).count());
+        myLatency.iteration[slow].record(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+    }
+
+    OctetAccount::endThread();
+}
+
+
+// With --blocking, how many blocking calls said we may have lost
+//   locks, and how many times the two accounts' locks really were
+//   among them (the others may have been any of the thread's locks).
+std::atomic<long> lostCalls(0), goneCalls(0);
+
+// Like futz, but with --blocking: moves money between two random
+//   accounts, sleeps in octet::blocking, and moves money again. Only
+//   if the call may have lost the locks does it take them again; if it
+//   says it didn't, we had better still hold them.
+void futzBlocking(OctetAccount* accounts, int threadNum, Settings settings)
+{
+    OctetAccount::startThread();
+
+    std::default_random_engine engine(100*threadNum);
+    std::uniform_int_distribution<int> dis(0,NUM_ACCOUNTS-1);
+
+    Latency& myLatency = latency[threadNum];
+    long lost = 0, gone = 0;
+
+    for (int i = 0; i < NUM_ITERATIONS; ++i) {
+        int from = dis(engine);
+        int to   = dis(engine);
+
+        if (from == to) {--i; continue; }
+
+        octet::Lock& fromLock = accounts[from].lock_;
+        octet::Lock& toLock = accounts[to].lock_;
+
+        bool slow = ! (fromLock.holds(true) && toLock.holds(true));
+
+        auto start = std::chrono::steady_clock::now();
+
+        octet::lock(fromLock, true, toLock, true);
+
+        auto locked = std::chrono::steady_clock::now();
+
+        --accounts[from].balance_;
+        ++accounts[to].balance_;
+
+        bool mayHaveLost;
+        octet::blocking([&]{ std::this_thread::sleep_for(
+                                 std::chrono::microseconds(settings.blocking)); },
+                        &mayHaveLost);
+
+        bool held = fromLock.holds(true) && toLock.holds(true);
+        assert (held || mayHaveLost);
+
+        if (mayHaveLost) {
+            ++lost;
+            if (! held) ++gone;
+            octet::lock(fromLock, true, toLock, true);
+        }
+
+        --accounts[from].balance_;
+        ++accounts[to].balance_;
+
+        auto end = std::chrono::steady_clock::now();
+
+        myLatency.lock[slow].record(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(locked - start).count());
+        myLatency.iteration[slow].record(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+    }
 
+    lostCalls += lost;
+    goneCalls += gone;
+
+    OctetAccount::endThread();
+}
+
+
+#if OCTET_COMPACT_LOCKS
+
+// With --intrusive, a lockable integer that takes a single word.
+template <bool LockInHighHalf>
+struct IntrusiveAccount {
+    using Lock = octet::BasicIntrusiveLock<octet::DefaultPolicy, LockInHighHalf>;
+
+    // Where the balance is (as a 32-bit two's complement number).
+    static const unsigned BALANCE_SHIFT = LockInHighHalf ? 0 : 32;
+
+    std::atomic<uint64_t> word_;
+
+    IntrusiveAccount() : word_(Lock::initialValue()) {}
+
+    Lock lock() { return Lock(word_); }
+
+    static int balanceIn(uint64_t data) { return int(uint32_t(data >> BALANCE_SHIFT)); }
+    static uint64_t dataFor(int balance) { return uint64_t(uint32_t(balance)) << BALANCE_SHIFT; }
+
+    int balance() { return balanceIn(lock().data()); }
+};
+
+// Like futz, but with --intrusive: moves money with setData (out of one
+//   account) and compareExchangeData (into another). We hold both locks,
+//   so nobody else can change the balances, and the exchange must
+//   succeed, even if a requester changes the lock half meanwhile.
+template <bool LockInHighHalf>
+void futzIntrusive(IntrusiveAccount<LockInHighHalf>* accounts, int threadNum,
+                   Settings)
+{
+    using Account = IntrusiveAccount<LockInHighHalf>;
+
+    OctetAccount::startThread();
 
     std::default_random_engine engine(100*threadNum);
     std::uniform_int_distribution<int> dis(0,NUM_ACCOUNTS-1);
 
+    Latency& myLatency = latency[threadNum];
+
     for (int i = 0; i < NUM_ITERATIONS; ++i) {
-#if CONTENTION
         int from  = dis(engine);
         int to    = dis(engine);
         int extra = dis(engine);
-#else
-        int from = 30*threadNum;
-        int to   = 30*threadNum + 1;
-        int extra = 30*threadNum + 2;
-        assert (extra < NUM_ACCOUNTS);
-#endif
 
-        // The read-modify-write code below doesn't work when (from==to).
         if (from == to) {--i; continue; }
 
+        auto fromLock = accounts[from].lock();
+        auto toLock = accounts[to].lock();
+        auto extraLock = accounts[extra].lock();
 
-        //////////////////
-        // Lock the three accounts
-        /////////////////
+        bool slow = ! (fromLock.holds(true) && toLock.holds(true) && extraLock.holds(false));
 
-        // from and to locked for writing; extra locked for reading.
+        auto start = std::chrono::steady_clock::now();
 
-#if USE_OCTET
-        octet::lock(accounts[from].lock_,  true,
-                    accounts[to].lock_,    true,
-                    accounts[extra].lock_, false);
-#else
-        std::lock(accounts[from].lock_,
-                  accounts[to].lock_,
-                  accounts[extra].lock_);
-#endif
+        octet::lock(fromLock, true, toLock, true, extraLock, false);
 
+        auto locked = std::chrono::steady_clock::now();
 
-        /////////////////////////////
-        // READ-MODIFY-WRITE sequence
-        /////////////////////////////
+        fromLock.setData(Account::dataFor(Account::balanceIn(fromLock.data()) - 1));
 
-        int from_balance = accounts[from].balance_;
-        int to_balance = accounts[to].balance_;
+        uint64_t expected = toLock.data();
+        bool exchanged =
+            toLock.compareExchangeData(expected,
+                                       Account::dataFor(Account::balanceIn(expected) + 1));
+        assert (exchanged);
+        (void) exchanged;
 
-        --from_balance;
-        ++to_balance;
+        (void) extraLock.data();
 
-        accounts[to].balance_= to_balance;
-        accounts[from].balance_ = from_balance;
+        auto end = std::chrono::steady_clock::now();
 
-#if USE_OCTET
-#if OCTET_UNLOCK
-        accounts[to].lock_.forceUnlock();
-        accounts[from].lock_.forceUnlock();
-        accounts[extra].lock_.forceUnlock();
-#endif
-#if DO_YIELD
-        // Optional (be a good citizen)
-        octet::yield();
-#endif
-#else
-        accounts[from].lock_.unlock();
-        accounts[to].lock_.unlock();
-        accounts[extra].lock_.unlock();
-#if DO_YIELD
-        std::this_thread::yield();
-#endif
+        myLatency.lock[slow].record(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(locked - start).count());
+        myLatency.iteration[slow].record(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+    }
+
+    OctetAccount::endThread();
+}
+
+#endif // OCTET_COMPACT_LOCKS
+
+// An account's balance (for checking the sum at the end).
+template <typename Account>
+int balanceOf(Account& account) { return account.balance_; }
+
+#if OCTET_COMPACT_LOCKS
+template <bool LockInHighHalf>
+int balanceOf(IntrusiveAccount<LockInHighHalf>& account) { return account.balance(); }
 #endif
+
+
+// The outcome of one run.
+struct Result {
+    long long elapsed;     // ms
+    long long cpuElapsed;  // ms
+    Latency latency;       // all threads' (but the busy owner's)
+};
+
+// Runs the test once, with timing: every thread runs body. Latencies
+//    are reported for threads firstReported and up.
+template <typename Account>
+Result runThreads(const Settings& settings, void (*body)(Account*, int, Settings),
+                  int firstReported)
+{
+    Account* accounts = new Account[NUM_ACCOUNTS];
+    std::thread* thread = new std::thread[NUM_THREADS];
+
+    latency.assign(NUM_THREADS, Latency());
+
+    auto start = std::chrono::steady_clock::now();
+    std::clock_t cpuStart = std::clock();
+
+    for (int i = 0; i < NUM_THREADS; ++i) {
+        thread[i] = std::thread(body, accounts, i, settings);
+    }
+
+    for (int i = 0; i < NUM_THREADS; ++i) {
+        thread[i].join();
+    }
+
+    auto end = std::chrono::steady_clock::now();
+
+    Result result;
+    result.elapsed =
+       std::chrono::duration_cast<std::chrono::milliseconds>(end-start).count();
+
+    // CPU time summed over all threads (which can exceed the elapsed time
+    //    on a multicore machine, or be much less if threads are sleeping).
+    result.cpuElapsed = (std::clock() - cpuStart) * 1000 / CLOCKS_PER_SEC;
+
+    // Verify that nothing went wrong.
+    int sum = 0;
+    for (int i = 0; i < NUM_ACCOUNTS; ++i) {
+        sum += balanceOf(accounts[i]);
+    }
+    assert (sum == 0);
+
+    for (int i = firstReported; i < NUM_THREADS; ++i) {
+        result.latency.merge(latency[i]);
     }
 
-#if USE_OCTET
-    // octet::atomic_printf("Ending thread %d\n", threadNum);
-    octet::shutdownPerthread();
+    // Clean up
+    delete[] accounts;
+    delete[] thread;
+
+    return result;
+}
+
+// Runs futz once, with timing.
+template <typename Account, bool Yield, typename Pattern, bool Unlock, bool Release,
+          int BusyMode>
+Result run(const Settings& settings)
+{
+    Pattern::setUp(settings);
+
+    // (Chosen here rather than by runWith, which would instantiate
+    //    everything else twice as often for each of them.)
+    using Body = void (*)(Account*, int, Settings);
+    Body bodies[2][2] = {
+        { futz<Account, Yield, Pattern, Unlock, Release, BusyMode, false, false>,
+          futz<Account, Yield, Pattern, Unlock, Release, BusyMode, false, true> },
+        { futz<Account, Yield, Pattern, Unlock, Release, BusyMode, true, false>,
+          futz<Account, Yield, Pattern, Unlock, Release, BusyMode, true, true> }
+    };
+    Body body = bodies[settings.reads > 0][settings.sleep > 0];
+
+    return runThreads<Account>(settings, body, BusyMode >= 0 ? 1 : 0);
+}
+
+// Turns the run-time settings into template arguments, one at a time.
+//    (Octet-only settings are always off for mutexes; see valid() below.)
+
+template <typename Account, bool Yield, typename Pattern, bool Unlock, bool Release>
+Result runWith(const Settings& s)
+{
+    if (s.busyOwner <= 0) return run<Account, Yield, Pattern, Unlock, Release, -1>(s);
+
+    switch (s.busyMode) {
+        case 1:  return run<Account, Yield, Pattern, Unlock, Release, Account::OCTET ? 1 : 0>(s);
+        case 2:  return run<Account, Yield, Pattern, Unlock, Release, Account::OCTET ? 2 : 0>(s);
+        default: return run<Account, Yield, Pattern, Unlock, Release, 0>(s);
+    }
+}
+
+template <typename Account, bool Yield, typename Pattern, bool Unlock>
+Result runWith(const Settings& s)
+{
+    return s.release ? runWith<Account, Yield, Pattern, Unlock, Account::OCTET>(s)
+                     : runWith<Account, Yield, Pattern, Unlock, false>(s);
+}
+
+template <typename Account, bool Yield, typename Pattern>
+Result runWith(const Settings& s)
+{
+    return s.unlock ? runWith<Account, Yield, Pattern, Account::OCTET>(s)
+                    : runWith<Account, Yield, Pattern, false>(s);
+}
+
+template <typename Account, bool Yield>
+Result runWith(const Settings& s)
+{
+    switch (s.pattern) {
+        case Settings::DISJOINT: return runWith<Account, Yield, Disjoint>(s);
+        case Settings::ZIPF:     return runWith<Account, Yield, Zipf>(s);
+        case Settings::HOT_SET:  return runWith<Account, Yield, HotSet<false>>(s);
+        case Settings::PHASED:   return runWith<Account, Yield, HotSet<true>>(s);
+        default:                 return runWith<Account, Yield, Uniform>(s);
+    }
+}
+
+template <typename Account>
+Result runWith(const Settings& s)
+{
+    return s.yield ? runWith<Account, true>(s)
+                   : runWith<Account, false>(s);
+}
+
+Result runWith(const Settings& s)
+{
+    // (--lock-set, --blocking and --intrusive have loops of their own.)
+    if (s.lockSet > 0) return runThreads<OctetAccount>(s, futzSet, 0);
+    if (s.blocking > 0) {
+        lostCalls = goneCalls = 0;
+        return runThreads<OctetAccount>(s, futzBlocking, 0);
+    }
+#if OCTET_COMPACT_LOCKS
+    if (s.intrusive == 1) {
+        return runThreads<IntrusiveAccount<true>>(s, futzIntrusive<true>, 0);
+    }
+    if (s.intrusive == 2) {
+        return runThreads<IntrusiveAccount<false>>(s, futzIntrusive<false>, 0);
+    }
 #endif
 
-    return;
+    return s.octet ? runWith<OctetAccount>(s)
+                   : runWith<MutexAccount>(s);
+}
+
+
+// Prints one line of the latency table.
+void printLatency(const char* what, const Histogram& h)
+{
+    if (h.total == 0) return;
+
+    std::cout << std::left << std::setw(22) << what << std::right
+              << std::setw(12) << h.total;
+    for (double p : { 50.0, 90.0, 99.0, 99.9 }) {
+        std::cout << std::setw(12) << h.percentile(p) / 1000.0;
+    }
+    std::cout << std::setw(12) << h.max / 1000.0 << std::endl;
+}
+
+// Reports the latency percentiles (of everyone but the busy thread).
+void printLatency(const Latency& latency, bool octet)
+{
+    std::cout << std::fixed << std::setprecision(3)
+              << "latency (us)                 count         p50         p90         p99       p99.9         max"
+              << std::endl;
+
+    Histogram lock = latency.lock[0], iteration = latency.iteration[0];
+    lock.merge(latency.lock[1]);
+    iteration.merge(latency.iteration[1]);
+
+    printLatency("lock", lock);
+    if (octet) {
+        printLatency("  fast path", latency.lock[0]);
+        printLatency("  slow path", latency.lock[1]);
+    }
+    printLatency("iteration", iteration);
+    if (octet) {
+        printLatency("  fast path", latency.iteration[0]);
+        printLatency("  slow path", latency.iteration[1]);
+    }
+    std::cout << std::endl;
+    std::cout.unsetf(std::ios::floatfield);
+}
+
+// The access pattern, with its parameters.
+std::string describePattern(const Settings& s)
+{
+    std::ostringstream out;
+    out << PATTERN_NAMES[s.pattern];
+    switch (s.pattern) {
+        case Settings::ZIPF:    out << "(" << s.skew << ")"; break;
+        case Settings::HOT_SET: out << "(" << s.hotSet << "," << s.locality << "%)"; break;
+        case Settings::PHASED:  out << "(" << s.hotSet << "," << s.locality << "%,"
+                                    << s.phase << ")"; break;
+        default: break;
+    }
+    return out.str();
+}
+
+// Checks for combinations that don't make sense.
+bool valid(const Settings& s, std::string& why)
+{
+    if (! s.octet && (s.unlock || s.release || s.profile || s.busyMode)) {
+        why = "--unlock, --release, --profile and --busy-mode only make sense "
+              "when we are using Octet barriers";
+        return false;
+    }
+    if (s.pattern == Settings::DISJOINT && NUM_ACCOUNTS < 30*NUM_THREADS) {
+        why = "--no-contention needs at least 30 accounts per thread";
+        return false;
+    }
+    if (NUM_ACCOUNTS < 2) {
+        why = "we need at least 2 accounts to move money between";
+        return false;
+    }
+    if (s.skew < 0 || s.hotSet < 1 || s.phase < 1 ||
+        s.locality < 0 || s.locality > 100 || s.reads < 0 || s.reads > 100) {
+        why = "--zipf, --hot-set and --phased must be positive, and "
+              "--locality and --reads percentages";
+        return false;
+    }
+    int loops = (s.lockSet > 0) + (s.blocking > 0) + (s.intrusive > 0);
+    if (loops > 0 &&
+        (! s.octet || s.yield || s.pattern != Settings::UNIFORM || s.reads ||
+         s.unlock || s.release || s.busyOwner > 0 || s.sleep > 0 || loops > 1)) {
+        why = "--lock-set, --blocking and --intrusive choose their own accounts, "
+              "and only combine with --profile";
+        return false;
+    }
+    if (s.intrusive && ! OCTET_COMPACT_LOCKS) {
+        why = "--intrusive needs a build with OCTET_COMPACT_LOCKS";
+        return false;
+    }
+    if (s.lockSet < 0 || s.lockSet == 1 || s.lockSet > NUM_ACCOUNTS) {
+        why = "--lock-set needs at least 2, and at most as many as there are "
+              "accounts";
+        return false;
+    }
+    if (s.hotSet < 2 && s.locality == 100 &&
+        (s.pattern == Settings::HOT_SET || s.pattern == Settings::PHASED)) {
+        why = "a hot set of 1 account needs --locality below 100";
+        return false;
+    }
+    return true;
+}
+
+void usage(const char* program)
+{
+    std::cout << "usage: " << program << " [options] [threads [iterations [accounts]]]\n"
+              << "  --octet / --mutex    lock with octet (default) or recursive mutexes\n"
+              << "  --yield              yield at the end of each iteration\n"
+              << "  --no-contention      each thread uses its own accounts\n"
+              << "  --zipf[=S]           pick accounts with Zipf skew S (0.99)\n"
+              << "  --hot-set[=N]        each thread favors its own N accounts (3)\n"
+              << "  --phased[=L]         ... and moves to the next thread's every L\n"
+              << "                           iterations (1000)\n"
+              << "  --locality=P         how often (%) threads pick from their hot set (90)\n"
+              << "  --reads=P            how often (%) iterations only read (0)\n"
+              << "  --unlock             force-unlock the accounts after each iteration\n"
+              << "  --release            release the accounts after each iteration\n"
+              << "  --profile=N          sample 1 in N lock transitions\n"
+              << "  --busy-owner=US      thread 0 computes for US microseconds per iteration\n"
+              << "  --busy-mode=M        ... and lets others in (0) never (1) by polling\n"
+              << "                           (2) by response signals\n"
+              << "  --sleep=US           every thread sleeps US microseconds per iteration\n"
+              << "  --lock-set=N         lock 2 to N accounts at once per iteration\n"
+              << "  --blocking=US        sleep US microseconds in octet::blocking while\n"
+              << "                           holding two accounts, per iteration\n"
+              << "  --intrusive[=low]    accounts are 64-bit words, with intrusive locks\n"
+              << "                           in the high (or low) half\n"
+              << "  --matrix             run every combination of --mutex, --yield,\n"
+              << "                           --no-contention (or not) and --unlock\n";
 }
-namespace octet {
-    extern int INTERMEDIATE_BACKOFF_EXPLIMIT;
-    extern int INTERMEDIATE_BACKOFF_RETRIES;
+
+// Runs every combination of the four basic modes (keeping any other
+//    settings), and prints a table. The contended runs use the access
+//    pattern we were given (uniform, unless it was --no-contention), and
+//    the uncontended runs get as many accounts as they need.
+void runMatrix(const Settings& base)
+{
+    std::cout << "  lock   yield   pattern  unlock        ms    cpu ms"
+              << "   lock p50 (us)   lock p99 (us)" << std::endl;
+
+    Settings::Pattern contended =
+        base.pattern == Settings::DISJOINT ? Settings::UNIFORM : base.pattern;
+
+    for (bool octet : { true, false }) {
+        for (bool yield : { false, true }) {
+            for (bool contention : { true, false }) {
+                for (bool unlock : { false, true }) {
+                    if (! octet && unlock) continue;
+
+                    Settings s = base;
+                    s.octet = octet;
+                    s.yield = yield;
+                    s.pattern = contention ? contended : Settings::DISJOINT;
+                    s.unlock = unlock;
+
+                    if (! octet) s.release = false, s.profile = 0, s.busyMode = 0;
+
+                    // Give each thread its own accounts, if need be.
+                    int accounts = NUM_ACCOUNTS;
+                    if (! contention) NUM_ACCOUNTS = std::max(NUM_ACCOUNTS, 30*NUM_THREADS);
+
+                    std::cout << std::setw(6) << (octet ? "octet" : "mutex")
+                              << std::setw(8) << yield
+                              << std::setw(10) << PATTERN_NAMES[s.pattern]
+                              << std::setw(8) << unlock;
+
+                    std::string why;
+                    if (! valid(s, why)) {
+                        NUM_ACCOUNTS = accounts;
+                        std::cout << "   skipped: " << why << std::endl;
+                        continue;
+                    }
+
+                    Result r = runWith(s);
+
+                    NUM_ACCOUNTS = accounts;
+
+                    std::cout << std::setw(10) << r.elapsed
+                              << std::setw(10) << r.cpuElapsed;
+
+                    Histogram lock = r.latency.lock[0];
+                    lock.merge(r.latency.lock[1]);
+                    std::cout << std::setw(16) << lock.percentile(50) / 1000.0
+                              << std::setw(16) << lock.percentile(99) / 1000.0
+                              << std::endl;
+                }
+            }
+        }
+    }
+    std::cout << std::endl;
 }
 
 int main(int argc, char** argv)
 {
     // Command-line argument processing
 
-    std::vector<std::string> args(argv, argv+argc);
+    Settings settings;
+    bool matrix = false;
+    std::vector<std::string> args;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = [&]() { return std::stoi(arg.substr(arg.find('=') + 1)); };
+
+        // Whether arg is the option, with or without a value.
+        auto is = [&](const std::string& option) {
+            return arg == option || arg.compare(0, option.size() + 1, option + "=") == 0;
+        };
+        bool hasValue = arg.find('=') != std::string::npos;
+
+        if      (arg == "--octet")         settings.octet = true;
+        else if (arg == "--mutex")         settings.octet = false;
+        else if (arg == "--yield")         settings.yield = true;
+        else if (arg == "--uniform")       settings.pattern = Settings::UNIFORM;
+        else if (arg == "--no-contention") settings.pattern = Settings::DISJOINT;
+        else if (is("--zipf")) {
+            settings.pattern = Settings::ZIPF;
+            if (hasValue) settings.skew = std::stod(arg.substr(arg.find('=') + 1));
+        }
+        else if (is("--hot-set")) {
+            settings.pattern = Settings::HOT_SET;
+            if (hasValue) settings.hotSet = value();
+        }
+        else if (is("--phased")) {
+            settings.pattern = Settings::PHASED;
+            if (hasValue) settings.phase = value();
+        }
+        else if (arg.compare(0, 11, "--locality=") == 0)   settings.locality = value();
+        else if (arg.compare(0, 8, "--reads=") == 0)       settings.reads = value();
+        else if (arg == "--unlock")        settings.unlock = true;
+        else if (arg == "--release")       settings.release = true;
+        else if (arg == "--matrix")        matrix = true;
+        else if (arg.compare(0, 10, "--profile=") == 0)    settings.profile = value();
+        else if (arg.compare(0, 13, "--busy-owner=") == 0) settings.busyOwner = value();
+        else if (arg.compare(0, 12, "--busy-mode=") == 0)  settings.busyMode = value();
+        else if (arg.compare(0, 8, "--sleep=") == 0)       settings.sleep = value();
+        else if (arg.compare(0, 11, "--lock-set=") == 0)   settings.lockSet = value();
+        else if (arg.compare(0, 11, "--blocking=") == 0)   settings.blocking = value();
+        else if (arg == "--intrusive" || arg == "--intrusive=high") settings.intrusive = 1;
+        else if (arg == "--intrusive=low") settings.intrusive = 2;
+        else if (arg.compare(0, 2, "--") == 0 || arg == "-h") {
+            usage(argv[0]);
+            return arg == "--help" || arg == "-h" ? 0 : 1;
+        }
+        else args.push_back(arg);
+    }
 
-    if (argc >= 2) {
-        NUM_THREADS = std::max(1, std::stoi(args[1]));
+    if (args.size() >= 1) {
+        NUM_THREADS = std::max(1, std::stoi(args[0]));
+    }
+    if (args.size() >= 2) {
+        NUM_ITERATIONS = std::max(1, std::stoi(args[1]));
     }
-    if (argc >= 3) {
-        NUM_ITERATIONS = std::max(1, std::stoi(args[2]));
+    if (args.size() >= 3) {
+        NUM_ACCOUNTS = std::max(1, std::stoi(args[2]));
+    }
+
+    // (The matrix chooses the lock, yielding, pattern and unlocking
+    //    itself, and checks each combination again before running it;
+    //    but the rest of the settings had better make sense.)
+    Settings shared = settings;
+    if (matrix) {
+        shared.octet = true;
+        if (shared.pattern == Settings::DISJOINT) shared.pattern = Settings::UNIFORM;
     }
-    if (argc >= 4) {
-        NUM_ACCOUNTS = std::max(1, std::stoi(args[3]));
+
+    std::string why;
+    if (! valid(shared, why)) {
+        std::cout << why << std::endl;
+        return 1;
     }
 
     // Where and when did this test run?
@@ -234,20 +1231,31 @@ int main(int argc, char** argv)
               << hostname << "   "
               << std::endl;
 
-    std::cout << "Compiled settings: USE_OCTET=" << USE_OCTET << "  "
-              << "DO_YIELD=" << DO_YIELD << "  "
-              << "CONTENTION=" << CONTENTION << "   "
-              << "OCTET_UNLOCK=" << OCTET_UNLOCK << "  "
-              << std::endl;
+    if (! matrix) {
+        std::cout << "Settings: USE_OCTET=" << settings.octet << "  "
+                  << "DO_YIELD=" << settings.yield << "  "
+                  << "PATTERN=" << describePattern(settings) << "   "
+                  << "READS=" << settings.reads << "%  "
+                  << "OCTET_UNLOCK=" << settings.unlock << "  "
+                  << "OCTET_RELEASE=" << settings.release << "  "
+                  << "PROFILE=" << settings.profile << "  "
+                  << "BUSY_OWNER=" << settings.busyOwner << "  "
+                  << "BUSY_OWNER_MODE=" << settings.busyMode << "  "
+                  << "SLEEP=" << settings.sleep << "  "
+                  << "LOCK_SET=" << settings.lockSet << "  "
+                  << "BLOCKING=" << settings.blocking << "  "
+                  << "INTRUSIVE=" << settings.intrusive << "  "
+                  << std::endl;
+    }
 
-#if USE_OCTET
     // Log the compile-time options for the octet library
     std::cout << "Library  settings: DEBUG=" << DEBUG << "  "
               << "SEQUENTIAL=" << SEQUENTIAL << "  "
               << "STATISTICS=" << STATISTICS << "  "
               << "READSHARED=" << READSHARED << "  "
+              << "PARKING=" << PARKING << "  "
+              << "COMPACT_LOCKS=" << OCTET_COMPACT_LOCKS << "  "
               << std::endl;
-#endif
 
     std::cout << "Run-time settings: NUM_THREADS= " << NUM_THREADS << "  "
               << "NUM_ITERATIONS=" << NUM_ITERATIONS << "  "
@@ -257,41 +1265,44 @@ int main(int argc, char** argv)
 
     // Set up the test.
 
-    accounts = new Account[NUM_ACCOUNTS];
-    std::thread* thread = new std::thread[NUM_THREADS];
-
-    // Run the test, with timing.
-
-    auto start = std::chrono::system_clock::now();
-
-    for (int i = 0; i < NUM_THREADS; ++i) {
-        thread[i] = std::thread(futz, i);
+    if (settings.profile) {
+        octet::setProfileSampling( settings.profile );
     }
 
-    for (int i = 0; i < NUM_THREADS; ++i) {
-        thread[i].join();
+    if (settings.busyOwner > 0 && settings.busyMode == 2) {
+        if (! octet::setResponseSignal( SIGRTMIN, RESPONSE_SIGNAL_US )) {
+            std::cout << "(response signals unavailable)" << std::endl;
+        }
     }
 
-    auto end = std::chrono::system_clock::now();
-    auto elapsed =
-       std::chrono::duration_cast<std::chrono::milliseconds>(end-start).count();
-
-    // Verify that nothing went wrong.
-    int sum = 0;
-    for (int i = 0; i < NUM_ACCOUNTS; ++i) {
-        sum += accounts[i].balance_;
+    if (matrix) {
+        runMatrix(settings);
+        return 0;
     }
-    assert (sum == 0);
 
+    // Run the test, with timing.
+
+    Result result = runWith(settings);
 
     // Display running-time
-    std::cout << elapsed << "ms  " ;
+    std::cout << result.elapsed << "ms  " ;
+    std::cout << "(cpu " << result.cpuElapsed << "ms)  " ;
     std::cout << std::endl << std::endl;
 
-    // Clean up
-    delete[] accounts;
-    delete[] thread;
+    printLatency(result.latency, settings.octet);
+
+    if (settings.blocking > 0) {
+        std::cout << "blocking calls: " << long(NUM_THREADS) * NUM_ITERATIONS
+                  << "  may have lost locks: " << lostCalls
+                  << "  lost the accounts': " << goneCalls << std::endl << std::endl;
+    }
+
+    if (settings.octet && STATISTICS) {
+        octet::printStatistics( octet::getStatistics() );
+    }
+    if (settings.profile) {
+        octet::printProfile();
+    }
 
     return 0;
 }
-
@@ -0,0 +1,622 @@
+/*
+ * sweep.cpp
+ *
+ * Locks modeled on the "Octet" barriers of Bond et al.
+ *    "OCTET: Capturing and Controlling Cross-Thread Dependencies Efficiently"
+ *
+ * Measures how octet locks scale, and checks for regressions.
+ *
+ *    Runs the stresstest workload (move money between two random
+ *          accounts, and read a third) for a fixed time at each point
+ *          of a sweep: thread counts from 1 to twice the number of cores,
+ *          times a few contention levels (numbers of accounts), with each
+ *          thread pinned to a core
+ *    Repeats the whole sweep several times, and reports the median
+ *          throughput of each point (and, with --json=FILE, writes all
+ *          the measurements as JSON)
+ *    With --baseline=FILE (the JSON of an earlier sweep), compares each
+ *          point with the baseline, and exits with status 1 if any is
+ *          slower by more than the threshold, *and* the slowdown is
+ *          statistically significant (a one-sided Mann-Whitney U test
+ *          over the repeats, which doesn't mind the odd outlier, corrected
+ *          for testing many points at once). It refuses (status 2) to
+ *          compare with a baseline made on a different number of CPUs,
+ *          with different library settings, or with a different --ms
+ *    At the end of each run, the sum of all accounts should be zero.
+ *
+ *    "make perfcheck" compares against sweep-baseline.json, or records
+ *    it if there isn't one yet. Baselines only mean something on the
+ *    machine (and library settings) they were made with, so make a new
+ *    one whenever those change, with
+ *          ./sweep --json=sweep-baseline.json
+ *
+ * Author: Christopher A. Stone <stone@cs.hmc.edu>
+ *
+ */
+
+////////////////////////
+// CONTROL PARAMETERS //
+////////////////////////
+
+int DURATION_MS = 200;           // How long each run lasts
+
+int REPEATS = 7;                 // How many times we run each point
+
+double THRESHOLD = 10;           // Slowdown (%) that counts as a regression
+
+const double SIGNIFICANCE = 0.05;  // ... if it's this unlikely to be chance
+
+// Contention levels: fewer accounts ==> more contention.
+const int DEFAULT_ACCOUNTS[] = { 10, 1000, 100000 };
+
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "octet.hpp"
+
+
+////////////////////////
+// Pinning
+////////////////////////
+
+// The CPUs we may run on.
+std::vector<int> cpus()
+{
+    std::vector<int> result;
+#ifdef __linux__
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set)) result.push_back(cpu);
+        }
+    }
+#endif
+    if (result.empty()) {
+        for (unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu) {
+            result.push_back(cpu);
+        }
+    }
+    return result;
+}
+
+// Pins the calling thread to the given CPU, if we can.
+bool pin(int cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void) cpu;
+    return false;
+#endif
+}
+
+
+////////////////////////
+// The workload
+////////////////////////
+
+struct Account {
+    volatile int balance_;
+    octet::Lock lock_;
+
+    Account() : balance_(0) {}
+};
+
+std::atomic<bool> running;
+
+// Moves money between random accounts until time runs out (as in
+//    stresstest), counting the iterations. Pins itself to the given CPU
+//    (unless it's -1) before it starts, so no work runs unpinned.
+void futz(Account* accounts, int numAccounts, int threadNum, int cpu, long* ops)
+{
+    if (cpu >= 0) pin(cpu);
+
+    octet::initPerthread();
+
+    std::default_random_engine engine(100*threadNum);
+    std::uniform_int_distribution<int> dis(0,numAccounts-1);
+
+    long n = 0;
+    while (running.load(std::memory_order_relaxed)) {
+        int from  = dis(engine);
+        int to    = dis(engine);
+        int extra = dis(engine);
+
+        if (from == to) continue;
+
+        octet::lock(accounts[from].lock_,  true,
+                    accounts[to].lock_,    true,
+                    accounts[extra].lock_, false);
+
+        int from_balance = accounts[from].balance_;
+        int to_balance = accounts[to].balance_;
+
+        accounts[to].balance_ = to_balance + 1;
+        accounts[from].balance_ = from_balance - 1;
+
+        ++n;
+    }
+
+    *ops = n;
+
+    octet::shutdownPerthread();
+}
+
+// Runs one point of the sweep once; returns the throughput (iterations/s).
+double run(int numThreads, int numAccounts, const std::vector<int>* cpuList)
+{
+    std::vector<Account> accounts(numAccounts);
+    std::vector<long> ops(numThreads);
+
+    running = true;
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < numThreads; ++i) {
+        // (Round robin over the CPUs, if we're pinning.)
+        int cpu = cpuList ? (*cpuList)[i % cpuList->size()] : -1;
+        threads.push_back(std::thread(futz, accounts.data(), numAccounts, i, cpu, &ops[i]));
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(DURATION_MS));
+    running = false;
+
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    auto end = std::chrono::steady_clock::now();
+
+    // Verify that nothing went wrong.
+    long long sum = 0;
+    for (auto& account : accounts) sum += account.balance_;
+    assert (sum == 0);
+
+    long total = 0;
+    for (long n : ops) total += n;
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    return total / seconds;
+}
+
+
+////////////////////////
+// Statistics
+////////////////////////
+
+// A point of the sweep, and its throughput in each repeat.
+using Point = std::pair<int, int>;   // threads, accounts
+using Samples = std::map< Point, std::vector<double> >;
+
+double median(std::vector<double> v)
+{
+    std::sort(v.begin(), v.end());
+    size_t n = v.size();
+    return n == 0 ? 0 : n % 2 ? v[n/2] : (v[n/2 - 1] + v[n/2]) / 2;
+}
+
+// Above this many (old, new) pairs, slowerPValue approximates rather
+//    than counting every ordering.
+const int EXACT_PAIRS = 2500;
+
+// The chance of the new samples ranking this low (or lower) against the
+//    old ones, if they all came from the same distribution: the one-sided
+//    p-value of a Mann-Whitney U test, computed exactly for small samples,
+//    and with the normal approximation for large ones.
+double slowerPValue(const std::vector<double>& old, const std::vector<double>& now)
+{
+    int n = old.size(), m = now.size();
+    if (n == 0 || m == 0) return 1;
+
+    // U = the number of (old, new) pairs in which new is faster
+    //    (ties count half).
+    double u = 0;
+    for (double a : old) {
+        for (double b : now) {
+            u += b > a ? 1 : b == a ? 0.5 : 0;
+        }
+    }
+
+    if (n*m > EXACT_PAIRS) {
+        // U is roughly normal, with mean nm/2 and a variance that ties
+        //    (runs of t equal samples) reduce a little.
+        std::vector<double> all(old);
+        all.insert(all.end(), now.begin(), now.end());
+        std::sort(all.begin(), all.end());
+
+        double N = n + m, ties = 0;
+        for (size_t i = 0, j; i < all.size(); i = j) {
+            for (j = i; j < all.size() && all[j] == all[i]; ++j) {}
+            double t = j - i;
+            ties += t*t*t - t;
+        }
+
+        double variance = n*m / 12.0 * ((N + 1) - ties / (N * (N - 1)));
+        if (variance <= 0) return 1;
+
+        // (The 0.5 is a continuity correction.)
+        double z = (u + 0.5 - n*m / 2.0) / std::sqrt(variance);
+        return 0.5 * std::erfc(-z / std::sqrt(2.0));
+    }
+
+    // ways[j][k] = the number of orderings of i old and j new samples
+    //    with U == k, for each i in turn. (The largest sample is either
+    //    new, and faster than all i old ones, or old, and faster than none
+    //    of the new ones; so going from i-1 to i, ways[j][k] gains
+    //    ways[j-1][k-i], which we've already brought up to date.)
+    std::vector<std::vector<double>> ways(m + 1, std::vector<double>(n*m + 1, 0));
+    for (int j = 0; j <= m; ++j) ways[j][0] = 1;
+
+    for (int i = 1; i <= n; ++i) {
+        for (int j = 1; j <= m; ++j) {
+            for (int k = i*j; k >= i; --k) {
+                ways[j][k] += ways[j-1][k-i];
+            }
+        }
+    }
+
+    double atMost = 0, total = 0;
+    for (int k = 0; k <= n*m; ++k) {
+        if (k <= u) atMost += ways[m][k];
+        total += ways[m][k];
+    }
+    return atMost / total;
+}
+
+
+////////////////////////
+// JSON
+////////////////////////
+
+// How the library was built.
+std::string library()
+{
+    std::ostringstream out;
+    out << "DEBUG=" << DEBUG << " SEQUENTIAL=" << SEQUENTIAL
+        << " STATISTICS=" << STATISTICS << " READSHARED=" << READSHARED
+        << " PARKING=" << PARKING << " OCTET_COMPACT_LOCKS=" << OCTET_COMPACT_LOCKS
+        << " SPIN_ON_INTERMEDIATE=" << SPIN_ON_INTERMEDIATE;
+    return out.str();
+}
+
+// What was measured where, so that we know what a baseline is good for.
+std::string context()
+{
+    const int MAXHOSTNAME_LENGTH = 256;
+    char hostname[MAXHOSTNAME_LENGTH] = "";
+    gethostname(hostname, MAXHOSTNAME_LENGTH);
+
+    std::ostringstream out;
+    out << "\"host\": \"" << hostname << "\", "
+        << "\"cpus\": " << cpus().size() << ", "
+        << "\"duration_ms\": " << DURATION_MS << ", "
+        << "\"repeats\": " << REPEATS << ", "
+        << "\"library\": \"" << library() << "\"";
+    return out.str();
+}
+
+// Writes one point per line (which is all readJSON can read back).
+void writeJSON(std::ostream& out, const Samples& samples)
+{
+    out << "{\"context\": {" << context() << "}," << std::endl
+        << " \"points\": [" << std::endl;
+
+    size_t i = 0;
+    for (const auto& point : samples) {
+        out << "  {\"threads\": " << point.first.first << ", "
+            << "\"accounts\": " << point.first.second << ", "
+            << "\"median_ops_per_sec\": " << static_cast<long long>(median(point.second)) << ", "
+            << "\"ops_per_sec\": [";
+        for (size_t r = 0; r < point.second.size(); ++r) {
+            out << (r ? ", " : "") << static_cast<long long>(point.second[r]);
+        }
+        out << "]}" << (++i < samples.size() ? "," : "") << std::endl;
+    }
+
+    out << " ]}" << std::endl;
+}
+
+// Finds "key": in line, and reads the number after it.
+bool readNumber(const std::string& line, const std::string& key, double& value)
+{
+    size_t at = line.find("\"" + key + "\":");
+    if (at == std::string::npos) return false;
+    std::istringstream in(line.substr(at + key.size() + 3));
+    return bool(in >> value);
+}
+
+// Finds "key": in line, and reads the string after it.
+bool readString(const std::string& line, const std::string& key, std::string& value)
+{
+    size_t at = line.find("\"" + key + "\": \"");
+    if (at == std::string::npos) return false;
+    size_t start = at + key.size() + 5;
+    size_t end = line.find('"', start);
+    if (end == std::string::npos) return false;
+    value = line.substr(start, end - start);
+    return true;
+}
+
+// Why a baseline made in the given context can't be compared with this
+//    run (or "" if it can). The machine's name doesn't matter, but its
+//    size, the library's settings and the length of each run do.
+std::string mismatch(const std::string& context)
+{
+    double numCpus, duration;
+    std::string flags;
+    if (! readNumber(context, "cpus", numCpus) ||
+        ! readNumber(context, "duration_ms", duration) ||
+        ! readString(context, "library", flags)) {
+        return "it doesn't say what it was measured on";
+    }
+
+    std::ostringstream why;
+    if (int(numCpus) != int(cpus().size())) {
+        why << "it was made on " << numCpus << " CPU(s), not " << cpus().size();
+    } else if (flags != library()) {
+        why << "it was made with a library built with " << flags
+            << ", not " << library();
+    } else if (int(duration) != DURATION_MS) {
+        why << "it was made with --ms=" << duration << ", not " << DURATION_MS;
+    }
+    return why.str();
+}
+
+// Reads the points back from the output of writeJSON.
+bool readJSON(const std::string& filename, Samples& samples, std::string& context)
+{
+    std::ifstream in(filename);
+    if (! in) return false;
+
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.find("\"context\":") != std::string::npos) {
+            context = line;
+            continue;
+        }
+
+        double threads, accounts;
+        if (! readNumber(line, "threads", threads) ||
+            ! readNumber(line, "accounts", accounts)) continue;
+
+        size_t open = line.find('[', line.find("\"ops_per_sec\":"));
+        size_t close = line.find(']', open);
+        if (open == std::string::npos || close == std::string::npos) return false;
+
+        std::string list = line.substr(open + 1, close - open - 1);
+        std::replace(list.begin(), list.end(), ',', ' ');
+        std::istringstream values(list);
+
+        std::vector<double>& v = samples[Point(int(threads), int(accounts))];
+        std::copy(std::istream_iterator<double>(values), std::istream_iterator<double>(),
+                  std::back_inserter(v));
+    }
+    return true;
+}
+
+
+////////////////////////
+// Driver
+////////////////////////
+
+void usage(const char* program)
+{
+    std::cout << "usage: " << program << " [options]\n"
+              << "  --threads=N,N,...    thread counts (1, 2, 4, ... up to 2x the CPUs)\n"
+              << "  --accounts=N,N,...   contention levels (10,1000,100000)\n"
+              << "  --ms=N               length of each run (200)\n"
+              << "  --repeats=N          runs of each point (7)\n"
+              << "  --no-pin             don't pin threads to CPUs\n"
+              << "  --json=FILE          write the results to FILE as JSON\n"
+              << "  --baseline=FILE      compare with an earlier --json FILE, and exit\n"
+              << "                           with status 1 if anything got slower\n"
+              << "  --threshold=PCT      ... by more than PCT percent (10)\n";
+}
+
+std::vector<int> numberList(const std::string& list)
+{
+    std::vector<int> result;
+    std::istringstream in(list);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        result.push_back(std::max(1, std::stoi(item)));
+    }
+    return result;
+}
+
+int main(int argc, char** argv)
+{
+    // Command-line argument processing
+
+    std::vector<int> cpuList = cpus();
+    int numCpus = cpuList.size();
+
+    std::vector<int> threadCounts;
+    std::vector<int> accountCounts(std::begin(DEFAULT_ACCOUNTS), std::end(DEFAULT_ACCOUNTS));
+    bool pinning = true;
+    std::string jsonFile, baselineFile;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        std::string value = arg.substr(arg.find('=') + 1);
+
+        if      (arg.compare(0, 10, "--threads=") == 0)   threadCounts = numberList(value);
+        else if (arg.compare(0, 11, "--accounts=") == 0)  accountCounts = numberList(value);
+        else if (arg.compare(0, 5, "--ms=") == 0)         DURATION_MS = std::max(1, std::stoi(value));
+        else if (arg.compare(0, 10, "--repeats=") == 0)   REPEATS = std::max(1, std::stoi(value));
+        else if (arg.compare(0, 12, "--threshold=") == 0) THRESHOLD = std::stod(value);
+        else if (arg.compare(0, 7, "--json=") == 0)       jsonFile = value;
+        else if (arg.compare(0, 11, "--baseline=") == 0)  baselineFile = value;
+        else if (arg == "--no-pin")                       pinning = false;
+        else {
+            usage(argv[0]);
+            return arg == "--help" || arg == "-h" ? 0 : 2;
+        }
+    }
+
+    if (threadCounts.empty()) {
+        for (int t = 1; t < 2*numCpus; t *= 2) threadCounts.push_back(t);
+        threadCounts.push_back(numCpus);
+        threadCounts.push_back(2*numCpus);
+        std::sort(threadCounts.begin(), threadCounts.end());
+        threadCounts.erase(std::unique(threadCounts.begin(), threadCounts.end()),
+                           threadCounts.end());
+    }
+
+    for (int accounts : accountCounts) {
+        if (accounts < 2) {
+            std::cout << "we need at least 2 accounts to move money between" << std::endl;
+            return 2;
+        }
+    }
+
+    Samples baseline;
+    std::string baselineContext;
+    if (! baselineFile.empty() && ! readJSON(baselineFile, baseline, baselineContext)) {
+        std::cout << "can't read baseline " << baselineFile << std::endl;
+        return 2;
+    }
+    if (! baselineFile.empty()) {
+        std::string why = mismatch(baselineContext);
+        if (! why.empty()) {
+            std::cout << "can't compare with baseline " << baselineFile << ": "
+                      << why << std::endl
+                      << "(make a new one here with --json=" << baselineFile << ")"
+                      << std::endl;
+            return 2;
+        }
+    }
+
+    std::cout << "Context: {" << context() << "}" << std::endl
+              << "Pinning: " << (pinning ? "on" : "off") << std::endl << std::endl;
+
+    // Run the sweep, a whole repeat at a time (so that any drift in the
+    //    machine's speed affects all points alike), after a warm-up run.
+
+    run(threadCounts.back(), accountCounts.front(), pinning ? &cpuList : nullptr);
+
+    Samples samples;
+    for (int r = 0; r < REPEATS; ++r) {
+        for (int threads : threadCounts) {
+            for (int accounts : accountCounts) {
+                samples[Point(threads, accounts)].push_back(
+                    run(threads, accounts, pinning ? &cpuList : nullptr));
+            }
+        }
+    }
+
+    // Compare with the baseline. We're testing every point, so to keep
+    //    the chance of a false alarm anywhere below SIGNIFICANCE, we use
+    //    the Holm-Bonferroni method: the smallest p-value must be below
+    //    SIGNIFICANCE / (number of points), the next smallest below
+    //    SIGNIFICANCE / (number of points - 1), and so on.
+
+    std::map<Point, double> pValues;
+    for (const auto& point : samples) {
+        auto old = baseline.find(point.first);
+        if (old == baseline.end() || old->second.empty()) continue;
+
+        pValues[point.first] = slowerPValue(old->second, point.second);
+    }
+
+    // (Even the most consistent slowdown must be able to pass the
+    //    strictest of those tests.)
+    bool enoughRepeats = true;
+    for (const auto& p : pValues) {
+        std::vector<double> slowest(samples[p.first].size(), -1);
+        enoughRepeats = enoughRepeats &&
+            slowerPValue(baseline[p.first], slowest) < SIGNIFICANCE / pValues.size();
+    }
+
+    std::vector< std::pair<double, Point> > ranked;
+    for (const auto& p : pValues) ranked.push_back(std::make_pair(p.second, p.first));
+    std::sort(ranked.begin(), ranked.end());
+
+    std::map<Point, bool> significant;
+    for (size_t i = 0; i < ranked.size(); ++i) {
+        if (ranked[i].first >= SIGNIFICANCE / (ranked.size() - i)) break;
+        significant[ranked[i].second] = true;
+    }
+
+    // Report.
+
+    if (! baselineFile.empty()) {
+        std::cout << "Baseline: " << baselineContext << std::endl << std::endl;
+    }
+
+    std::cout << "threads  accounts   median ops/s";
+    if (! baselineFile.empty()) std::cout << "     baseline   change  p-value";
+    std::cout << std::endl;
+
+    int regressions = 0;
+    for (const auto& point : samples) {
+        double now = median(point.second);
+
+        std::cout << std::setw(7) << point.first.first
+                  << std::setw(10) << point.first.second
+                  << std::setw(15) << static_cast<long long>(now);
+
+        auto old = baseline.find(point.first);
+        if (pValues.count(point.first)) {
+            double before = median(old->second);
+            double change = before ? 100 * (now - before) / before : 0;
+            bool regressed = change < -THRESHOLD && significant[point.first];
+            if (regressed) ++regressions;
+
+            std::cout << std::setw(13) << static_cast<long long>(before)
+                      << std::setw(8) << std::fixed << std::setprecision(1) << change << "%"
+                      << std::setw(9) << std::setprecision(4) << pValues[point.first]
+                      << (regressed ? "  SLOWER" : "");
+            std::cout.unsetf(std::ios::floatfield);
+        }
+        std::cout << std::endl;
+    }
+    std::cout << std::endl;
+
+    if (! jsonFile.empty()) {
+        std::ofstream out(jsonFile);
+        writeJSON(out, samples);
+        if (! out) {
+            std::cout << "can't write " << jsonFile << std::endl;
+            return 2;
+        }
+    }
+
+    if (! enoughRepeats) {
+        std::cout << "(too few repeats, here or in the baseline, to tell whether "
+                  << "anything is slower)" << std::endl;
+    }
+
+    if (regressions) {
+        std::cout << regressions << " point(s) significantly slower than the baseline"
+                  << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
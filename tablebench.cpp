@@ -0,0 +1,210 @@
+/*
+ * tablebench.cpp
+ *
+ * Locks modeled on the "Octet" barriers of Bond et al.
+ *    "OCTET: Capturing and Controlling Cross-Thread Dependencies Efficiently"
+ *
+ * Measures the memory/conflict trade-off of octet::LockTable.
+ *
+ *    Creates a large array of "accounts" (plain ints, with no lock of
+ *          their own), all initially 0
+ *    For each stripe count, starts some threads, each of which
+ *          repeatedly moves money between two random accounts (and
+ *          reads a third), locking them through a LockTable
+ *    Reports the time, the table's memory, and how often threads
+ *          conflicted over a stripe for the same account ("true") or
+ *          for different accounts that happen to share it ("false"),
+ *          and compares with one octet::Lock per account.
+ *    At the end of each run, the sum of all accounts should be zero.
+ *
+ * Author: Christopher A. Stone <stone@cs.hmc.edu>
+ *
+ */
+
+////////////////////////
+// CONTROL PARAMETERS //
+////////////////////////
+
+int NUM_THREADS = 4;             // How many threads run at once
+
+int NUM_ITERATIONS = 100000;     // How much work each thread does
+
+long NUM_ACCOUNTS = 1000000;     // How many accounts the threads are choosing from
+
+// Stripe counts to try (unless given on the command line)
+const long DEFAULT_STRIPES[] = { 64, 1024, 16384, 262144 };
+
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "octet.hpp"
+
+// Always gather conflict statistics, whatever the library's defaults.
+using Table = octet::BasicLockTable< octet::LockPolicy<READSHARED != 0, true> >;
+
+volatile int* balances;
+
+// Moves money between random accounts, with the locks in a table.
+void futzTable(Table* table, int threadNum)
+{
+    octet::initPerthread();
+
+    std::default_random_engine engine(100*threadNum);
+    std::uniform_int_distribution<long> dis(0,NUM_ACCOUNTS-1);
+
+    for (int i = 0; i < NUM_ITERATIONS; ++i) {
+        long from  = dis(engine);
+        long to    = dis(engine);
+        long extra = dis(engine);
+
+        if (from == to) {--i; continue; }
+
+        std::pair<uintptr_t, bool> keys[] = { { uintptr_t(from),  true },
+                                              { uintptr_t(to),    true },
+                                              { uintptr_t(extra), false } };
+        table->lock(keys, keys + 3);
+
+        int from_balance = balances[from];
+        int to_balance = balances[to];
+        (void) balances[extra];
+
+        balances[to] = to_balance + 1;
+        balances[from] = from_balance - 1;
+    }
+
+    octet::shutdownPerthread();
+}
+
+// The same, with one lock per account.
+void futzLocks(octet::Lock* locks, int threadNum)
+{
+    octet::initPerthread();
+
+    std::default_random_engine engine(100*threadNum);
+    std::uniform_int_distribution<long> dis(0,NUM_ACCOUNTS-1);
+
+    for (int i = 0; i < NUM_ITERATIONS; ++i) {
+        long from  = dis(engine);
+        long to    = dis(engine);
+        long extra = dis(engine);
+
+        if (from == to) {--i; continue; }
+
+        octet::lock(locks[from],  true,
+                    locks[to],    true,
+                    locks[extra], false);
+
+        int from_balance = balances[from];
+        int to_balance = balances[to];
+        (void) balances[extra];
+
+        balances[to] = to_balance + 1;
+        balances[from] = from_balance - 1;
+    }
+
+    octet::shutdownPerthread();
+}
+
+// Runs the threads, and checks that no money was created or destroyed.
+template <typename Work, typename Locks>
+long long run(Work work, Locks locks)
+{
+    std::fill(balances, balances + NUM_ACCOUNTS, 0);
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < NUM_THREADS; ++i) {
+        threads.push_back(std::thread(work, locks, i));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    auto end = std::chrono::steady_clock::now();
+
+    long long sum = 0;
+    for (long i = 0; i < NUM_ACCOUNTS; ++i) {
+        sum += balances[i];
+    }
+    assert (sum == 0);
+
+    return std::chrono::duration_cast<std::chrono::milliseconds>(end-start).count();
+}
+
+int main(int argc, char** argv)
+{
+    // Command-line argument processing:
+    //    tablebench [threads [iterations [accounts [stripes...]]]]
+
+    std::vector<std::string> args(argv, argv+argc);
+
+    if (argc >= 2) {
+        NUM_THREADS = std::max(1, std::stoi(args[1]));
+    }
+    if (argc >= 3) {
+        NUM_ITERATIONS = std::max(1, std::stoi(args[2]));
+    }
+    if (argc >= 4) {
+        NUM_ACCOUNTS = std::max(2L, std::stol(args[3]));
+    }
+
+    std::vector<long> stripeCounts(std::begin(DEFAULT_STRIPES), std::end(DEFAULT_STRIPES));
+    if (argc >= 5) {
+        stripeCounts.clear();
+        for (int i = 4; i < argc; ++i) {
+            stripeCounts.push_back(std::max(1L, std::stol(args[i])));
+        }
+    }
+
+    std::cout << "Run-time settings: NUM_THREADS=" << NUM_THREADS << "  "
+              << "NUM_ITERATIONS=" << NUM_ITERATIONS << "  "
+              << "NUM_ACCOUNTS=" << NUM_ACCOUNTS << "  "
+              << std::endl;
+
+    balances = new int[NUM_ACCOUNTS];
+
+    long acquisitions = 3L * NUM_THREADS * NUM_ITERATIONS;
+
+    for (long stripes : stripeCounts) {
+        Table table(stripes);
+
+        long long elapsed = run(futzTable, &table);
+
+        octet::LockTableStatistics stats = table.getStatistics();
+
+        std::cout << "stripes " << stats.stripes << "  "
+                  << stats.bytes / 1024 << "kB  "
+                  << elapsed << "ms  "
+                  << "conflicts: " << stats.trueConflicts << " true, "
+                  << stats.falseConflicts << " false ("
+                  << 100.0 * stats.falseConflicts / acquisitions << "% of acquisitions)"
+                  << std::endl;
+    }
+
+    {
+        octet::Lock* locks = new octet::Lock[NUM_ACCOUNTS];
+
+        long long elapsed = run(futzLocks, locks);
+
+        std::cout << "one lock per account  "
+                  << NUM_ACCOUNTS * sizeof(octet::Lock) / 1024 << "kB  "
+                  << elapsed << "ms"
+                  << std::endl << std::endl;
+
+        delete[] locks;
+    }
+
+    delete[] balances;
+
+    return 0;
+}